@@ -4,72 +4,509 @@
  * (C) Copyright 2020 Topic Embedded Products B.V. (http://www.topic.nl).
  */
 
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/ctype.h>
+#include <linux/crc32.h>
+#include <linux/debugfs.h>
+#include <linux/firmware.h>
+#include <linux/hrtimer.h>
+#include <linux/kobject.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
 #include <linux/of.h>
 #include <linux/of_graph.h>
+#include <linux/percpu.h>
 #include <linux/platform_device.h>
+#include <linux/pm_qos.h>
+#include <linux/sched.h>
 #include <linux/init.h>
+#include <linux/jump_label.h>
+#include <linux/kthread.h>
+#include <linux/interconnect.h>
 #include <linux/nvmem-consumer.h>
 #include <linux/slab.h>
 #include <linux/list.h>
+#include <linux/math64.h>
 #include <linux/mutex.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/thermal.h>
+#include <linux/workqueue.h>
 
+#include <net/genetlink.h>
 #include <media/media-device.h>
+#include <media/media-request.h>
 #include <media/v4l2-async.h>
 #include <media/v4l2-common.h>
 #include <media/v4l2-device.h>
+#include <media/v4l2-event.h>
 #include <media/v4l2-ctrls.h>
 #include <media/v4l2-fwnode.h>
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Topic Embedded Products <www.topic.nl>");
 
+/**
+ * struct xvip_ctrl_cache_entry - Mirrored value of a subdev control
+ * @entity: graph entity owning the control
+ * @ctrl: the mirrored control
+ * @value: last known value of the control
+ * @updated: time at which @value was last refreshed
+ */
+struct xvip_ctrl_cache_entry {
+	struct xvip_graph_entity *entity;
+	struct v4l2_ctrl *ctrl;
+	s64 value;
+	ktime_t updated;
+};
+
+/**
+ * struct xvip_ctrl_update - Pending control change of a batch
+ * @entity: graph entity owning the control
+ * @ctrl: the control to change
+ * @value: the new value
+ */
+struct xvip_ctrl_update {
+	struct xvip_graph_entity *entity;
+	struct v4l2_ctrl *ctrl;
+	s64 value;
+};
+
+/**
+ * struct xvip_request - Media request queued on the composite device
+ * @req: the media request
+ * @list: entry in the composite device's list of queued requests
+ */
+struct xvip_request {
+	struct media_request req;
+	struct list_head list;
+};
+
+enum xvip_setting_type {
+	XVIP_SETTING_FORMAT,
+	XVIP_SETTING_INTERVAL,
+	XVIP_SETTING_CTRL,
+	XVIP_SETTING_LINK,
+};
+
+/**
+ * struct xvip_setting - Target setting of one entity in a configuration
+ * @type: what the setting changes
+ * @entity: graph entity the setting applies to
+ * @format: pad format, for XVIP_SETTING_FORMAT
+ * @interval: frame interval, for XVIP_SETTING_INTERVAL
+ * @ctrl: control, for XVIP_SETTING_CTRL
+ * @value: control value, for XVIP_SETTING_CTRL
+ * @link: link from the entity to another one, for XVIP_SETTING_LINK
+ * @enable: link state, for XVIP_SETTING_LINK
+ */
+struct xvip_setting {
+	enum xvip_setting_type type;
+	struct xvip_graph_entity *entity;
+	union {
+		struct v4l2_subdev_format format;
+		struct v4l2_fract interval;
+		struct {
+			struct v4l2_ctrl *ctrl;
+			s64 value;
+		};
+		struct {
+			struct media_link *link;
+			bool enable;
+		};
+	};
+};
+
+/**
+ * struct xvip_config - Set of target settings for the pipeline
+ * @count: number of settings
+ * @settings: the settings, applied in this order
+ */
+struct xvip_config {
+	unsigned int count;
+	struct xvip_setting settings[];
+};
+
+/**
+ * struct xvip_profile - Named pipeline configuration
+ * @list: entry in the composite device's list of profiles
+ * @name: name of the profile
+ * @cfg: settings of the profile, validated when the profile is defined
+ */
+struct xvip_profile {
+	struct list_head list;
+	char *name;
+	struct xvip_config *cfg;
+};
+
+#define XVIP_NO_ENTITY		UINT_MAX
+
+/* Reasons for keeping a subdev in standby. */
+#define XVIP_STANDBY_USER	BIT(0)
+#define XVIP_STANDBY_THERMAL	BIT(1)
+
+/**
+ * struct xvip_component - Connected component of the media graph
+ * @source: id of the first source entity of the component, XVIP_NO_ENTITY if
+ *	it has none
+ * @first: index of the first entity of the component in the start order
+ * @num_entities: number of entities in the component
+ */
+struct xvip_component {
+	unsigned int source;
+	unsigned int first;
+	unsigned int num_entities;
+};
+
+/**
+ * struct xvip_graph_link - Link loaded from a precompiled graph description
+ * @source: firmware node of the source entity
+ * @source_pad: index of the source pad
+ * @sink: firmware node of the sink entity
+ * @sink_pad: index of the sink pad
+ * @flags: media link flags
+ */
+struct xvip_graph_link {
+	struct fwnode_handle *source;
+	unsigned int source_pad;
+	struct fwnode_handle *sink;
+	unsigned int sink_pad;
+	u32 flags;
+};
+
+/**
+ * struct xvip_sync_group - Composite devices whose streams start together
+ * @list: entry in the global list of sync groups
+ * @name: name of the group
+ * @members: composite devices in the group
+ * @skew: spread of the commit times of the members at the last start
+ */
+struct xvip_sync_group {
+	struct list_head list;
+	char *name;
+	struct list_head members;
+	ktime_t skew;
+};
+
+/**
+ * struct xvip_thermal - Thermal throttling of a sensor
+ * @list: entry in the composite device's list of throttled sensors
+ * @entity: throttled sensor
+ * @tz: thermal zone the temperature is read from, NULL to use @ctrl
+ * @ctrl: temperature control of the sensor, used when there's no @tz
+ * @scale: factor converting @ctrl values to millidegrees Celsius
+ * @trips: ascending trip temperatures, in millidegrees Celsius
+ * @num_trips: number of entries in @trips
+ * @intervals: frame intervals for the trip levels, the levels beyond the last
+ *	one put the sensor in standby
+ * @num_intervals: number of entries in @intervals
+ * @hysteresis: drop below a trip point required to leave its level
+ * @nominal: frame interval of the sensor before it was throttled
+ * @level: number of trip points currently crossed
+ * @temp: last temperature read
+ * @events: number of level changes
+ */
+struct xvip_thermal {
+	struct list_head list;
+	struct xvip_graph_entity *entity;
+	struct thermal_zone_device *tz;
+	struct v4l2_ctrl *ctrl;
+	u32 scale;
+	u32 *trips;
+	unsigned int num_trips;
+	struct v4l2_fract *intervals;
+	unsigned int num_intervals;
+	u32 hysteresis;
+	struct v4l2_fract nominal;
+	unsigned int level;
+	int temp;
+	unsigned int events;
+};
+
+/**
+ * struct xvip_stats - Event statistics, kept per CPU
+ * @events: events notified by the subdevs
+ * @frame_syncs: frame sync events
+ * @ctrl_notifies: control change notifications of the cached controls
+ */
+struct xvip_stats {
+	unsigned long events;
+	unsigned long frame_syncs;
+	unsigned long ctrl_notifies;
+};
+
+enum xvip_control_policy {
+	XVIP_CONTROL_NORMAL,
+	XVIP_CONTROL_FIFO_LOW,
+	XVIP_CONTROL_FIFO,
+};
+
 /**
  * struct xvip_composite_device - Xilinx Video IP device structure
  * @v4l2_dev: V4L2 device
  * @media_dev: media device
  * @dev: (OF) device
+ * @probe_time: time at which the probe started, to report the time taken by
+ *	the graph to complete
+ * @partitions: on the device bound to the platform device, list of all the
+ *	media devices the graph is partitioned into, itself included
+ * @partition: entry in the @partitions list
+ * @index: index of the partition, 0 for the device bound to the platform
+ *	device
  * @notifier: V4L2 asynchronous subdevs notifier
- * @entities: entities in the graph as a list of xvip_graph_entity
- * @num_subdevs: number of subdevs in the pipeline
+ * @fw_links: links of the precompiled graph description, NULL when the graph
+ *	is parsed from the device tree
+ * @num_fw_links: number of entries in @fw_links
+ * @entities: runtime state of the entities in the graph, indexed by the id
+ *	assigned when the subdev is bound
+ * @entities_size: number of entries in @entities, one per async subdev
+ * @num_subdevs: number of valid entries in @entities, set once all subdevs
+ *	are bound
+ * @stats: event statistics, summed over the CPUs when read
+ * @entity_frame_syncs: per CPU frame sync counts, indexed by entity id
+ * @lock: protects the streaming state and the per-entity statistics
+ * @is_streaming: true once the stream has been started
+ * @debugfs_dir: debugfs directory of this device
+ * @cached_cids: control IDs to mirror, from the "topic,cached-controls" property
+ * @num_cached_cids: number of entries in @cached_cids
+ * @ctrl_cache: mirrored control values, one entry per (subdev, control) pair
+ * @ctrl_cache_size: number of valid entries in @ctrl_cache
+ * @ctrl_cache_lock: protects @ctrl_cache values, @ctrl_cache_size and
+ *	@ctrl_cache_period_ms
+ * @ctrl_cache_work: periodic refresh of the mirrored control values
+ * @ctrl_cache_period_ms: refresh period, 0 to rely on change notifications
+ * @group_hold_cid: sensor group-hold control, from "topic,group-hold-control"
+ * @frame_seq: number of V4L2_EVENT_FRAME_SYNC events received from the subdevs
+ * @frame_wq: woken up on every frame-sync event
+ * @requests: queued media requests, in queueing order
+ * @requests_lock: protects @requests
+ * @request_work: applies the queued media requests
+ * @reconfig_changes: number of settings changed by the last reconfiguration
+ * @reconfig_gap: stream interruption caused by the last reconfiguration
+ * @reconfig_gap_frames: @reconfig_gap expressed in frames
+ * @profiles: named configurations as a list of xvip_profile
+ * @active_profile: profile the pipeline was last switched to, if still in effect
+ * @pipe: media pipeline used to validate the links
+ * @config_gen: incremented on every format or link change
+ * @validated_gen: value of @config_gen when the pipeline was last validated
+ * @validated_fmt: fingerprint of the active pad formats at that time
+ * @validation_result: result of the last validation
+ * @validate_work: revalidates the pipeline after a link change
+ * @components: connected components of the graph through enabled links
+ * @num_components: number of entries in @components
+ * @start_order: entity ids grouped by component, each group ordered from the
+ *	sources downstream
+ * @successor_offsets: index in @successors of the first successor of each
+ *	entity, with an extra entry marking the end of the last one
+ * @successors: ids of the entities fed by each entity through enabled links
+ * @downstream_ids: storage for the downstream chains of the sources
+ * @components_gen: value of @config_gen when @components was computed
+ * @sync_group: sync group the device belongs to, NULL if none
+ * @sync_entry: entry in the members list of @sync_group
+ * @sync_work: commits the stream of the device at @sync_deadline
+ * @sync_deadline: time at which the stream of the group is committed
+ * @sync_clock: clock of @sync_deadline and @commit_time
+ * @commit_time: time at which the stream was committed by @sync_work
+ * @commit_result: result of the commit done by @sync_work
+ * @start_timer: queues @sync_work shortly before a scheduled start
+ * @start_scheduled: a scheduled start is armed and not yet committed
+ * @qos: CPU latency request held while starting, and while streaming if
+ *	@qos_streaming is set
+ * @qos_latency_us: CPU latency bound of @qos, negative to disable it
+ * @qos_streaming: keep @qos while streaming, not only during the start
+ * @icc_path: interconnect path to memory, NULL if not described in DT
+ * @icc_bw: bandwidth currently voted on @icc_path, in kBps
+ * @control_worker: runs the stream control and thermal work, shared by all
+ *	the partitions of the platform device
+ * @control_policy: scheduling policy of @control_worker
+ * @control_cpus: CPUs @control_worker may run on, empty for all
+ * @control_lock: serializes the updates of @control_policy and @control_cpus
+ *	and their application to @control_worker
+ * @standby: the streaming sensors are in standby
+ * @device_entry: entry in the global list of devices, for the device bound
+ *	to the platform device
+ * @nl_users: number of netlink commands using the device after looking it up
+ *	in the global list
+ * @nl_wq: woken up when the last netlink command releases the device
+ * @nl_stats_work: multicasts the statistics periodically
+ * @nl_stats_period_ms: period of @nl_stats_work, 0 to disable it
+ * @thermals: sensors throttled on temperature
+ * @thermal_work: polls the temperature of the throttled sensors
+ * @thermal_period_ms: polling period of @thermal_work
  */
 struct xvip_composite_device {
 	struct v4l2_device v4l2_dev;
 	struct media_device media_dev;
 	struct device *dev;
+	ktime_t probe_time;
+
+	struct list_head partitions;
+	struct list_head partition;
+	unsigned int index;
 
 	struct v4l2_async_notifier notifier;
-	struct list_head entities;
+	struct xvip_graph_link *fw_links;
+	unsigned int num_fw_links;
+	struct xvip_graph_entity *entities;
+	unsigned int entities_size;
 	unsigned int num_subdevs;
+	struct xvip_stats __percpu *stats;
+	unsigned long __percpu *entity_frame_syncs;
 
+	struct mutex lock;
 	bool is_streaming;
+
+	struct dentry *debugfs_dir;
+
+	u32 *cached_cids;
+	unsigned int num_cached_cids;
+	struct xvip_ctrl_cache_entry *ctrl_cache;
+	unsigned int ctrl_cache_size;
+	spinlock_t ctrl_cache_lock;
+	struct delayed_work ctrl_cache_work;
+	unsigned int ctrl_cache_period_ms;
+
+	u32 group_hold_cid;
+	atomic_t frame_seq;
+	wait_queue_head_t frame_wq;
+
+	struct list_head requests;
+	spinlock_t requests_lock;
+	struct work_struct request_work;
+
+	unsigned int reconfig_changes;
+	ktime_t reconfig_gap;
+	u64 reconfig_gap_frames;
+
+	struct list_head profiles;
+	struct xvip_profile *active_profile;
+
+	struct media_pipeline pipe;
+	atomic_t config_gen;
+	unsigned int validated_gen;
+	u32 validated_fmt;
+	int validation_result;
+	struct work_struct validate_work;
+
+	struct xvip_component *components;
+	unsigned int num_components;
+	unsigned int *start_order;
+	unsigned int *successor_offsets;
+	unsigned int *successors;
+	unsigned int *downstream_ids;
+	unsigned int components_gen;
+
+	struct xvip_sync_group *sync_group;
+	struct list_head sync_entry;
+	struct work_struct sync_work;
+	ktime_t sync_deadline;
+	clockid_t sync_clock;
+	ktime_t commit_time;
+	int commit_result;
+	struct hrtimer start_timer;
+	bool start_scheduled;
+
+	struct pm_qos_request qos;
+	s32 qos_latency_us;
+	bool qos_streaming;
+
+	struct icc_path *icc_path;
+	u32 icc_bw;
+
+	struct kthread_worker *control_worker;
+	enum xvip_control_policy control_policy;
+	struct cpumask control_cpus;
+	struct mutex control_lock;
+
+	bool standby;
+	struct list_head device_entry;
+	atomic_t nl_users;
+	wait_queue_head_t nl_wq;
+	struct kthread_delayed_work nl_stats_work;
+	unsigned int nl_stats_period_ms;
+
+	struct list_head thermals;
+	struct kthread_delayed_work thermal_work;
+	unsigned int thermal_period_ms;
 };
 
 
 /**
- * struct xvip_graph_entity - Entity in the video graph
+ * struct xvip_graph_asd - Subdev in the video graph, as parsed from firmware
  * @asd: subdev asynchronous registration information
+ * @entity: runtime state of the subdev, assigned when bound
+ *
+ * Only used for binding, the notifier needs @asd until it is unregistered.
+ */
+struct xvip_graph_asd {
+	struct v4l2_async_subdev asd;
+	struct xvip_graph_entity *entity;
+};
+
+/**
+ * struct xvip_graph_entity - Runtime state of an entity in the video graph
  * @entity: media entity, from the corresponding V4L2 subdev
  * @subdev: V4L2 subdev
+ * @fwnode: firmware node of the subdev
  * @streaming: status of the V4L2 subdev if streaming or not
+ * @prepared: the subdev is powered on and configured, ready for s_stream
+ * @in_request: the control handler of the subdev is bound to the request
+ *	being applied
+ * @standby: reasons (XVIP_STANDBY_*) for which the prepared subdev is kept
+ *	in standby, it streams again once none holds
+ * @start_latency: time spent in s_power + s_stream during the last start,
+ *	only measured while the timing instrumentation is enabled
+ * @interval: frame interval reported by the subdev after the last start
+ * @interval_configured: the frame interval was set explicitly, don't apply
+ *	the start-up default
+ * @component: index of the connected component containing the entity
+ * @downstream: for source entities, the ids of the entities fed by it through
+ *	enabled links, starting with the source itself
+ * @num_downstream: number of entries in @downstream
  */
 struct xvip_graph_entity {
-	struct v4l2_async_subdev asd;
 	struct media_entity *entity;
-
-	
 	struct v4l2_subdev *subdev;
+	struct fwnode_handle *fwnode;
 	bool streaming;
+	bool prepared;
+	bool in_request;
+	unsigned int standby;
+
+	ktime_t start_latency;
+	struct v4l2_fract interval;
+	bool interval_configured;
+
+	unsigned int component;
+	unsigned int *downstream;
+	unsigned int num_downstream;
 };
 
-static struct xvip_composite_device *g_xdev;
 static int indication = 0;
 
+static LIST_HEAD(xvip_sync_groups);
+static DEFINE_MUTEX(xvip_sync_lock);
 
-static inline struct xvip_graph_entity *
-to_xvip_entity(struct v4l2_async_subdev *asd)
+/*
+ * Timing of the control and event paths, disabled by default and enabled from
+ * the "timing" file of the driver debugfs directory, for all devices.
+ */
+static DEFINE_STATIC_KEY_FALSE(xvip_timing_key);
+static struct dentry *xvip_debugfs_root;
+
+static LIST_HEAD(xvip_devices);
+static DEFINE_MUTEX(xvip_devices_lock);
+
+static struct genl_family xvip_nl_family;
+
+
+static inline struct xvip_graph_asd *
+to_xvip_asd(struct v4l2_async_subdev *asd)
 {
-	return container_of(asd, struct xvip_graph_entity, asd);
+	return container_of(asd, struct xvip_graph_asd, asd);
 }
 
 
@@ -77,38 +514,99 @@ to_xvip_entity(struct v4l2_async_subdev *asd)
  * Graph Management
  */
  
+static struct xvip_graph_asd *
+xvip_graph_find_asd(struct xvip_composite_device *xdev,
+		    const struct fwnode_handle *fwnode)
+{
+	struct v4l2_async_subdev *asd;
+
+	list_for_each_entry(asd, &xdev->notifier.asd_list, asd_list) {
+		if (asd->match.fwnode == fwnode)
+			return to_xvip_asd(asd);
+	}
+
+	return NULL;
+}
+
 static struct xvip_graph_entity *
 xvip_graph_find_entity(struct xvip_composite_device *xdev,
 		       const struct fwnode_handle *fwnode)
 {
-	struct xvip_graph_entity *entity;
-	struct v4l2_async_subdev *asd;
+	unsigned int i;
 
-	list_for_each_entry(asd, &xdev->notifier.asd_list, asd_list) {
-		entity = to_xvip_entity(asd);
-		if (entity->asd.match.fwnode == fwnode)
-			return entity;
+	for (i = 0; i < xdev->num_subdevs; i++) {
+		if (xdev->entities[i].fwnode == fwnode)
+			return &xdev->entities[i];
 	}
 
 	return NULL;
 }
 
+static inline struct xvip_graph_entity *
+xvip_entity_from_media(struct media_entity *entity)
+{
+	if (!is_media_entity_v4l2_subdev(entity))
+		return NULL;
+
+	return v4l2_get_subdev_hostdata(media_entity_to_v4l2_subdev(entity));
+}
+
 static struct xvip_graph_entity *
-xvip_graph_find_entity_from_media(struct xvip_composite_device *xdev,
-				  struct media_entity *entity)
+xvip_graph_find_entity_by_name(struct xvip_composite_device *xdev,
+			       const char *name)
 {
-	struct xvip_graph_entity *xvip_entity;
-	struct v4l2_async_subdev *asd;
+	unsigned int i;
 
-	list_for_each_entry(asd, &xdev->notifier.asd_list, asd_list) {
-		xvip_entity = to_xvip_entity(asd);
-		if (xvip_entity->entity == entity)
-			return xvip_entity;
+	for (i = 0; i < xdev->num_subdevs; i++) {
+		if (!strcmp(xdev->entities[i].entity->name, name))
+			return &xdev->entities[i];
 	}
 
 	return NULL;
 }
 
+/*
+ * Return the next whitespace separated token of *str and advance *str past
+ * it, or NULL when the string is exhausted. Tokens can be enclosed in double
+ * quotes, as entity names frequently contain spaces.
+ */
+static char *xvip_next_token(char **str)
+{
+	char *s = skip_spaces(*str);
+	char *token;
+
+	if (!*s)
+		return NULL;
+
+	if (*s == '"') {
+		token = ++s;
+		s = strchr(s, '"');
+		if (!s)
+			return NULL;
+	} else {
+		token = s;
+		while (*s && !isspace(*s))
+			s++;
+	}
+
+	if (*s)
+		*s++ = '\0';
+	*str = s;
+
+	return token;
+}
+
+static void xvip_graph_name_entity(struct media_entity *local)
+{
+	if(strcmp(local->name,"IMX274") == 0) {
+		if(indication == 0)
+			local->name = "IMX274_0";
+		else
+			local->name = "IMX274_1";
+		indication++;
+		//dev_dbg(xdev->dev, "device is now (%s)\n", local->name);
+	}
+}
 
 static int xvip_graph_build_one(struct xvip_composite_device *xdev,
 				struct xvip_graph_entity *entity)
@@ -124,19 +622,11 @@ static int xvip_graph_build_one(struct xvip_composite_device *xdev,
 	int ret = 0;
 
 	//dev_dbg(xdev->dev, "creating links for entity (%s)\n", local->name);
-	if(strcmp(local->name,"IMX274") == 0) {
-		if(indication == 0)
-			local->name = "IMX274_0";
-		else
-			local->name = "IMX274_1";
-		indication++;
-		//dev_dbg(xdev->dev, "device is now (%s)\n", local->name);
-	}
+	xvip_graph_name_entity(local);
 
 	while (1) {
 		/* Get the next endpoint and parse its link. */
-		ep = fwnode_graph_get_next_endpoint(entity->asd.match.fwnode,
-						    ep);
+		ep = fwnode_graph_get_next_endpoint(entity->fwnode, ep);
 		if (ep == NULL)
 			break;
 
@@ -245,63 +735,176 @@ static bool xvip_graph_entity_set_streaming(struct xvip_composite_device *xdev,
 	return status;
 }
 
-static int xvip_entity_start_stop(struct xvip_composite_device *xdev, struct xvip_graph_entity *entity, bool on)
+/*
+ * Record the frame interval the subdev runs at, for the statistics. Subdevs
+ * that don't implement g_frame_interval report a zero interval.
+ */
+static void xvip_entity_update_interval(struct xvip_graph_entity *entity)
 {
-	struct v4l2_subdev *subdev;
-	bool is_streaming;
-	int ret = 0;
+	struct v4l2_subdev_frame_interval ival = { .pad = 0 };
+	int ret;
 
-	dev_dbg(xdev->dev, "%s entity %s\n",
-		on ? "Starting" : "Stopping", entity->entity->name);
-	subdev = media_entity_to_v4l2_subdev(entity->entity);
+	ret = v4l2_subdev_call(entity->subdev, video, g_frame_interval, &ival);
+	if (ret < 0 || !ival.interval.numerator) {
+		entity->interval.numerator = 0;
+		entity->interval.denominator = 0;
+		return;
+	}
 
-	/* This is to maintain list of stream on/off devices */
-	is_streaming = xvip_graph_entity_set_streaming(xdev, entity, on);
+	entity->interval = ival.interval;
+}
 
-	/*
-	 * start or stop the subdev only once in case if they are
-	 * shared between sub-graphs
-	 */
-	if (on && !is_streaming) {
-		/* power-on subdevice */
-		ret = v4l2_subdev_call(subdev, core, s_power, 1);
-		if (ret < 0 && ret != -ENOIOCTLCMD) {
+/*
+ * Power the subdev on and apply the start-up configuration, everything but
+ * s_stream, so that the stream can be started with a single call later.
+ */
+static int xvip_entity_prepare(struct xvip_composite_device *xdev,
+			       struct xvip_graph_entity *entity)
+{
+	struct v4l2_subdev *subdev = entity->subdev;
+	ktime_t start = 0;
+	int ret;
+
+	if (entity->prepared || entity->streaming)
+		return 0;
+
+	if (static_branch_unlikely(&xvip_timing_key))
+		start = ktime_get();
+
+	/* power-on subdevice */
+	ret = v4l2_subdev_call(subdev, core, s_power, 1);
+	if (ret < 0 && ret != -ENOIOCTLCMD) {
+		dev_err(xdev->dev,
+			"s_power on failed on subdev\n");
+		return ret;
+	}
+
+	/* Check if the device is the IMX274 */
+	dev_dbg(xdev->dev, "subdev: (%s)\n", subdev->name);
+	if(strcmp(subdev->name,"IMX274") == 0 &&
+	   !entity->interval_configured) {
+		struct v4l2_fract fract = {
+			.numerator = 1,
+			.denominator = 60
+		};
+		struct v4l2_subdev_frame_interval ival = {
+			.interval = fract
+		};
+		dev_dbg(xdev->dev, "Going to change frame interval of subdev: (%s)\n", subdev->name);
+		ret = v4l2_subdev_call(subdev, video, s_frame_interval, &ival);
+		if (ret < 0) {
 			dev_err(xdev->dev,
-				"s_power on failed on subdev\n");
-			xvip_graph_entity_set_streaming(xdev, entity, 0);
+				"s_frame_interval on failed on subdev\n");
+			v4l2_subdev_call(subdev, core, s_power, 0);
 			return ret;
 		}
+		dev_dbg(xdev->dev, "Changing frame interval of subdev: (%s) succesfully\n", subdev->name);
+	}
 
-		/* Check if the device is the IMX274 */
-		dev_dbg(xdev->dev, "subdev: (%s)\n", subdev->name);
-		if(strcmp(subdev->name,"IMX274") == 0) {
-			struct v4l2_fract fract = {
-				.numerator = 1,
-				.denominator = 60
-			};
-			struct v4l2_subdev_frame_interval ival = {
-				.interval = fract
-			};
-			dev_dbg(xdev->dev, "Going to change frame interval of subdev: (%s)\n", subdev->name);
-			ret = v4l2_subdev_call(subdev, video, s_frame_interval, &ival);
-			if (ret < 0) {
+	entity->prepared = true;
+	entity->start_latency = start ? ktime_sub(ktime_get(), start) : 0;
+
+	return 0;
+}
+
+/* Start streaming on a prepared subdev. */
+static int xvip_entity_commit(struct xvip_composite_device *xdev,
+			      struct xvip_graph_entity *entity)
+{
+	struct v4l2_subdev *subdev = entity->subdev;
+	ktime_t start = 0;
+	int ret;
+
+	/*
+	 * start the subdev only once in case if they are shared between
+	 * sub-graphs
+	 */
+	if (xvip_graph_entity_set_streaming(xdev, entity, true))
+		return 0;
+
+	if (static_branch_unlikely(&xvip_timing_key))
+		start = ktime_get();
+
+	/* stream-on subdevice */
+	ret = v4l2_subdev_call(subdev, video, s_stream, 1);
+	if (ret < 0 && ret != -ENOIOCTLCMD) {
+		dev_err(xdev->dev,
+			"s_stream on failed on subdev\n");
+		xvip_graph_entity_set_streaming(xdev, entity, 0);
+		return ret;
+	}
+
+	if (start)
+		entity->start_latency = ktime_add(entity->start_latency,
+						  ktime_sub(ktime_get(), start));
+	xvip_entity_update_interval(entity);
+
+	return 0;
+}
+
+/*
+ * Put a streaming subdev in standby for @reason, stopping the stream but
+ * keeping it powered and configured, or release @reason. The subdev stops
+ * with the first reason and streams again when the last one is released.
+ */
+static int xvip_entity_standby(struct xvip_composite_device *xdev,
+			       struct xvip_graph_entity *entity,
+			       unsigned int reason, bool standby)
+{
+	unsigned int reasons;
+	int ret = 0;
+
+	reasons = standby ? entity->standby | reason
+			  : entity->standby & ~reason;
+
+	if (!entity->standby && reasons) {
+		if (xvip_graph_entity_set_streaming(xdev, entity, false)) {
+			ret = v4l2_subdev_call(entity->subdev, video,
+					       s_stream, 0);
+			if (ret < 0 && ret != -ENOIOCTLCMD) {
 				dev_err(xdev->dev,
-					"s_frame_interval on failed on subdev\n");
-				xvip_graph_entity_set_streaming(xdev, entity, 0);
+					"s_stream off failed on subdev\n");
+				xvip_graph_entity_set_streaming(xdev, entity,
+								true);
 				return ret;
 			}
-			dev_dbg(xdev->dev, "Changing frame interval of subdev: (%s) succesfully\n", subdev->name);
 		}
+	} else if (entity->standby && !reasons) {
+		ret = xvip_entity_commit(xdev, entity);
+		if (ret < 0)
+			return ret;
+	}
 
-		/* stream-on subdevice */
-		ret = v4l2_subdev_call(subdev, video, s_stream, 1);
-		if (ret < 0 && ret != -ENOIOCTLCMD) {
-			dev_err(xdev->dev,
-				"s_stream on failed on subdev\n");
+	entity->standby = reasons;
+
+	return 0;
+}
+
+static int xvip_entity_start_stop(struct xvip_composite_device *xdev, struct xvip_graph_entity *entity, bool on)
+{
+	struct v4l2_subdev *subdev;
+	int ret = 0;
+
+	dev_dbg(xdev->dev, "%s entity %s\n",
+		on ? "Starting" : "Stopping", entity->entity->name);
+	subdev = media_entity_to_v4l2_subdev(entity->entity);
+
+	if (on) {
+		ret = xvip_entity_prepare(xdev, entity);
+		if (ret < 0)
+			return ret;
+
+		ret = xvip_entity_commit(xdev, entity);
+		if (ret < 0) {
 			v4l2_subdev_call(subdev, core, s_power, 0);
-			xvip_graph_entity_set_streaming(xdev, entity, 0);
+			entity->prepared = false;
 		}
-	} else if (!on && is_streaming) {
+
+		return ret;
+	}
+
+	/* This is to maintain list of stream on/off devices */
+	if (xvip_graph_entity_set_streaming(xdev, entity, false)) {
 		/* stream-off subdevice */
 		ret = v4l2_subdev_call(subdev, video, s_stream, 0);
 		if (ret < 0 && ret != -ENOIOCTLCMD) {
@@ -309,316 +912,5307 @@ static int xvip_entity_start_stop(struct xvip_composite_device *xdev, struct xvi
 				"s_stream off failed on subdev\n");
 			xvip_graph_entity_set_streaming(xdev, entity, 1);
 		}
+	}
 
+	if (entity->prepared) {
 		/* power-off subdevice */
 		ret = v4l2_subdev_call(subdev, core, s_power, 0);
 		if (ret < 0 && ret != -ENOIOCTLCMD)
 			dev_err(xdev->dev,
 				"s_power off failed on subdev\n");
+		entity->prepared = false;
 	}
+	entity->standby = 0;
 
 	return ret;
 }
 
-static int xvip_graph_notify_complete(struct v4l2_async_notifier *notifier)
-{
-	struct xvip_graph_entity *entity;
-	struct v4l2_async_subdev *asd;
-	LIST_HEAD(ent_list);
-	int ret;
+/* -----------------------------------------------------------------------------
+ * Control Cache
+ *
+ * Selected controls of the bound subdevs are mirrored in the driver so that
+ * monitoring can read them without going to the hardware. Values are updated
+ * from the control framework's change notifications where the subdev's
+ * control handler allows it, and refreshed periodically otherwise (volatile
+ * controls such as temperatures never notify).
+ */
 
-	dev_dbg(g_xdev->dev, "notify complete, all subdevs registered\n");
+#define XVIP_CTRL_CACHE_DEFAULT_PERIOD_MS	1000
 
-	/* Create links for every entity. */
-	list_for_each_entry(asd, &g_xdev->notifier.asd_list, asd_list) {
-		entity = to_xvip_entity(asd);
-		ret = xvip_graph_build_one(g_xdev, entity);
-		if (ret < 0)
-			return ret;
+static bool xvip_ctrl_is_scalar(const struct v4l2_ctrl *ctrl)
+{
+	switch (ctrl->type) {
+	case V4L2_CTRL_TYPE_INTEGER:
+	case V4L2_CTRL_TYPE_BOOLEAN:
+	case V4L2_CTRL_TYPE_MENU:
+	case V4L2_CTRL_TYPE_INTEGER_MENU:
+	case V4L2_CTRL_TYPE_BITMASK:
+	case V4L2_CTRL_TYPE_INTEGER64:
+		return true;
+	default:
+		return false;
 	}
+}
 
-	dev_dbg(g_xdev->dev, "Going to register v4l2 device \n");
-
-	ret = v4l2_device_register_subdev_nodes(&g_xdev->v4l2_dev);
-	if (ret < 0)
-		dev_err(g_xdev->dev, "failed to register subdev nodes\n");
-	
-	return media_device_register(&g_xdev->media_dev);
+static s64 xvip_ctrl_cur_value(const struct v4l2_ctrl *ctrl)
+{
+	if (ctrl->type == V4L2_CTRL_TYPE_INTEGER64)
+		return ctrl->cur.val64;
+	return ctrl->cur.val;
 }
 
-static int xvip_graph_notify_bound(struct v4l2_async_notifier *notifier,
-				   struct v4l2_subdev *subdev,
-				   struct v4l2_async_subdev *unused)
+static void xvip_ctrl_cache_store(struct xvip_composite_device *xdev,
+				  struct v4l2_ctrl *ctrl, s64 value)
 {
-	struct xvip_graph_entity *entity;
-	struct v4l2_async_subdev *asd;
+	unsigned long flags;
+	unsigned int i;
 
-	/* Locate the entity corresponding to the bound subdev and store the
-	 * subdev pointer.
-	 */
-	list_for_each_entry(asd, &g_xdev->notifier.asd_list, asd_list) {
-		entity = to_xvip_entity(asd);
-		if (entity->asd.match.fwnode != subdev->fwnode)
+	spin_lock_irqsave(&xdev->ctrl_cache_lock, flags);
+	for (i = 0; i < xdev->ctrl_cache_size; i++) {
+		if (xdev->ctrl_cache[i].ctrl != ctrl)
 			continue;
-
-		if (entity->subdev) {
-			dev_err(g_xdev->dev, "duplicate subdev for node %p\n",
-				entity->asd.match.fwnode);
-			return -EINVAL;
-		}
-
-		//dev_dbg(g_xdev->dev, "subdev %s bound\n", subdev->name);
-		entity->entity = &subdev->entity;
-		entity->subdev = subdev;
-		return 0;
+		xdev->ctrl_cache[i].value = value;
+		xdev->ctrl_cache[i].updated = ktime_get();
+		break;
 	}
-
-	dev_err(g_xdev->dev, "no entity for subdev %s\n", subdev->name);
-	return -EINVAL;
+	spin_unlock_irqrestore(&xdev->ctrl_cache_lock, flags);
 }
 
-static const struct v4l2_async_notifier_operations xvip_graph_notify_ops = {
+/* Called by the control framework with the control handler lock held. */
+static void xvip_ctrl_cache_notify(struct v4l2_ctrl *ctrl, void *priv)
+{
+	struct xvip_composite_device *xdev = priv;
+
+	this_cpu_inc(xdev->stats->ctrl_notifies);
+	xvip_ctrl_cache_store(xdev, ctrl, xvip_ctrl_cur_value(ctrl));
+}
+
+static void xvip_ctrl_cache_refresh(struct work_struct *work)
+{
+	struct xvip_composite_device *xdev =
+		container_of(to_delayed_work(work),
+			     struct xvip_composite_device, ctrl_cache_work);
+	struct v4l2_ctrl *ctrl;
+	unsigned int period;
+	unsigned int i;
+	s64 value;
+
+	/*
+	 * Reading volatile controls goes to the hardware, don't hold the device
+	 * lock for it: the control handler lock serializes the reads with the
+	 * other users of the controls. The cache is emptied before this work is
+	 * cancelled, so an entry seen under the cache lock stays valid.
+	 */
+	for (i = 0; ; i++) {
+		spin_lock_irq(&xdev->ctrl_cache_lock);
+		ctrl = i < xdev->ctrl_cache_size ? xdev->ctrl_cache[i].ctrl
+						 : NULL;
+		spin_unlock_irq(&xdev->ctrl_cache_lock);
+		if (!ctrl)
+			break;
+
+		if (ctrl->type == V4L2_CTRL_TYPE_INTEGER64)
+			value = v4l2_ctrl_g_ctrl_int64(ctrl);
+		else
+			value = v4l2_ctrl_g_ctrl(ctrl);
+		xvip_ctrl_cache_store(xdev, ctrl, value);
+	}
+
+	spin_lock_irq(&xdev->ctrl_cache_lock);
+	period = xdev->ctrl_cache_size ? xdev->ctrl_cache_period_ms : 0;
+	spin_unlock_irq(&xdev->ctrl_cache_lock);
+
+	if (period)
+		schedule_delayed_work(&xdev->ctrl_cache_work,
+				      msecs_to_jiffies(period));
+}
+
+static int xvip_ctrl_cache_parse(struct xvip_composite_device *xdev)
+{
+	struct device_node *node = xdev->dev->of_node;
+	int count;
+
+	spin_lock_init(&xdev->ctrl_cache_lock);
+	INIT_DELAYED_WORK(&xdev->ctrl_cache_work, xvip_ctrl_cache_refresh);
+	xdev->ctrl_cache_period_ms = XVIP_CTRL_CACHE_DEFAULT_PERIOD_MS;
+
+	count = of_property_count_u32_elems(node, "topic,cached-controls");
+	if (count <= 0)
+		return 0;
+
+	xdev->cached_cids = devm_kcalloc(xdev->dev, count,
+					 sizeof(*xdev->cached_cids),
+					 GFP_KERNEL);
+	if (!xdev->cached_cids)
+		return -ENOMEM;
+
+	xdev->num_cached_cids = count;
+	return of_property_read_u32_array(node, "topic,cached-controls",
+					  xdev->cached_cids, count);
+}
+
+static int xvip_ctrl_cache_init(struct xvip_composite_device *xdev)
+{
+	struct xvip_ctrl_cache_entry *cache;
+	struct xvip_graph_entity *entity;
+	struct v4l2_ctrl *ctrl;
+	unsigned int size = 0;
+	unsigned int i, j;
+
+	if (!xdev->num_cached_cids)
+		return 0;
+
+	cache = kcalloc(xdev->num_subdevs * xdev->num_cached_cids,
+			sizeof(*cache), GFP_KERNEL);
+	if (!cache)
+		return -ENOMEM;
+
+	for (j = 0; j < xdev->num_subdevs; j++) {
+		entity = &xdev->entities[j];
+		if (!entity->subdev->ctrl_handler)
+			continue;
+
+		for (i = 0; i < xdev->num_cached_cids; i++) {
+			ctrl = v4l2_ctrl_find(entity->subdev->ctrl_handler,
+					      xdev->cached_cids[i]);
+			if (!ctrl)
+				continue;
+
+			if (!xvip_ctrl_is_scalar(ctrl)) {
+				dev_warn(xdev->dev,
+					 "cannot cache control %s of %s\n",
+					 ctrl->name, entity->entity->name);
+				continue;
+			}
+
+			cache[size].entity = entity;
+			cache[size].ctrl = ctrl;
+
+			v4l2_ctrl_lock(ctrl);
+			cache[size].value = xvip_ctrl_cur_value(ctrl);
+			cache[size].updated = ktime_get();
+			if (!ctrl->handler->notify ||
+			    ctrl->handler->notify == xvip_ctrl_cache_notify)
+				v4l2_ctrl_notify(ctrl, xvip_ctrl_cache_notify,
+						 xdev);
+			v4l2_ctrl_unlock(ctrl);
+
+			size++;
+		}
+	}
+
+	spin_lock_irq(&xdev->ctrl_cache_lock);
+	xdev->ctrl_cache = cache;
+	xdev->ctrl_cache_size = size;
+	spin_unlock_irq(&xdev->ctrl_cache_lock);
+
+	dev_dbg(xdev->dev, "caching %u controls\n", size);
+
+	/* Pick up the current value of volatile controls right away. */
+	schedule_delayed_work(&xdev->ctrl_cache_work, 0);
+
+	return 0;
+}
+
+static void xvip_ctrl_cache_cleanup(struct xvip_composite_device *xdev)
+{
+	struct xvip_ctrl_cache_entry *cache;
+	struct v4l2_ctrl *ctrl;
+	unsigned int size;
+	unsigned int i;
+
+	/* Empty the cache first, the refresh work stops re-arming itself. */
+	spin_lock_irq(&xdev->ctrl_cache_lock);
+	cache = xdev->ctrl_cache;
+	size = xdev->ctrl_cache_size;
+	xdev->ctrl_cache = NULL;
+	xdev->ctrl_cache_size = 0;
+	spin_unlock_irq(&xdev->ctrl_cache_lock);
+
+	cancel_delayed_work_sync(&xdev->ctrl_cache_work);
+
+	mutex_lock(&xdev->lock);
+
+	/*
+	 * Stop the notifications under the handler lock, so that no callback
+	 * can still be running once the cache is freed.
+	 */
+	for (i = 0; i < size; i++) {
+		ctrl = cache[i].ctrl;
+
+		v4l2_ctrl_lock(ctrl);
+		v4l2_ctrl_notify(ctrl, NULL, NULL);
+		if (ctrl->handler->notify == xvip_ctrl_cache_notify) {
+			ctrl->handler->notify = NULL;
+			ctrl->handler->notify_priv = NULL;
+		}
+		v4l2_ctrl_unlock(ctrl);
+	}
+
+	mutex_unlock(&xdev->lock);
+
+	kfree(cache);
+}
+
+/* -----------------------------------------------------------------------------
+ * Control Batches
+ *
+ * A batch holds control changes for any number of subdevs. While streaming,
+ * it is applied right after the next frame-sync event so that all changes land
+ * in the same frame, with the sensors' group-hold control (if configured)
+ * asserted while the registers are written.
+ */
+
+#define XVIP_FRAME_SYNC_TIMEOUT_MS	1000
+
+static void xvip_v4l2_notify(struct v4l2_subdev *sd, unsigned int notification,
+			     void *arg)
+{
+	struct xvip_composite_device *xdev =
+		container_of(sd->v4l2_dev, struct xvip_composite_device,
+			     v4l2_dev);
+	struct xvip_graph_entity *entity;
+	const struct v4l2_event *ev = arg;
+
+	if (notification != V4L2_DEVICE_NOTIFY_EVENT)
+		return;
+
+	this_cpu_inc(xdev->stats->events);
+
+	if (ev->type == V4L2_EVENT_FRAME_SYNC) {
+		this_cpu_inc(xdev->stats->frame_syncs);
+		entity = xvip_entity_from_media(&sd->entity);
+		if (entity)
+			this_cpu_inc(xdev->entity_frame_syncs[
+				entity - xdev->entities]);
+
+		atomic_inc(&xdev->frame_seq);
+		wake_up_all(&xdev->frame_wq);
+	}
+
+	/* The subdev changed its formats on its own, revalidate on start. */
+	if (ev->type == V4L2_EVENT_SOURCE_CHANGE)
+		atomic_inc(&xdev->config_gen);
+}
+
+static int xvip_ctrl_set(struct v4l2_ctrl *ctrl, s64 value)
+{
+	if (ctrl->type == V4L2_CTRL_TYPE_INTEGER64)
+		return v4l2_ctrl_s_ctrl_int64(ctrl, value);
+	return v4l2_ctrl_s_ctrl(ctrl, value);
+}
+
+static int xvip_ctrl_check(struct v4l2_ctrl *ctrl, s64 value)
+{
+	if (!xvip_ctrl_is_scalar(ctrl))
+		return -EINVAL;
+	if (ctrl->flags & V4L2_CTRL_FLAG_READ_ONLY)
+		return -EACCES;
+	if (ctrl->flags & V4L2_CTRL_FLAG_GRABBED)
+		return -EBUSY;
+	if (value < ctrl->minimum || value > ctrl->maximum)
+		return -ERANGE;
+	return 0;
+}
+
+static struct v4l2_ctrl *
+xvip_entity_group_hold(struct xvip_composite_device *xdev,
+		       struct xvip_graph_entity *entity)
+{
+	if (!xdev->group_hold_cid || !entity->subdev->ctrl_handler)
+		return NULL;
+
+	return v4l2_ctrl_find(entity->subdev->ctrl_handler,
+			      xdev->group_hold_cid);
+}
+
+static void xvip_ctrl_batch_hold(struct xvip_composite_device *xdev,
+				 const struct xvip_ctrl_update *updates,
+				 unsigned int count, bool hold)
+{
+	struct v4l2_ctrl *ctrl;
+	unsigned int i, j;
+
+	for (i = 0; i < count; i++) {
+		/* Only toggle the hold once per entity. */
+		for (j = 0; j < i; j++)
+			if (updates[j].entity == updates[i].entity)
+				break;
+		if (j < i)
+			continue;
+
+		ctrl = xvip_entity_group_hold(xdev, updates[i].entity);
+		if (ctrl)
+			v4l2_ctrl_s_ctrl(ctrl, hold);
+	}
+}
+
+/*
+ * Two frame periods of the slowest streaming subdev, or the default timeout
+ * when no frame interval is known.
+ */
+static unsigned long xvip_frame_sync_timeout(struct xvip_composite_device *xdev)
+{
+	struct xvip_graph_entity *entity;
+	u64 period_us = 0;
+	unsigned int i;
+
+	for (i = 0; i < xdev->num_subdevs; i++) {
+		entity = &xdev->entities[i];
+		if (!entity->streaming || !entity->interval.denominator)
+			continue;
+
+		period_us = max(period_us,
+				div_u64((u64)entity->interval.numerator *
+					USEC_PER_SEC,
+					entity->interval.denominator));
+	}
+
+	if (!period_us)
+		return msecs_to_jiffies(XVIP_FRAME_SYNC_TIMEOUT_MS);
+
+	return usecs_to_jiffies(2 * period_us) + 1;
+}
+
+/*
+ * Wait for the start of the next frame when streaming, so that changes made
+ * afterwards all land in the same frame. Must be called with the device lock
+ * held, so that nothing delays the changes past the frame boundary. Each
+ * waiter compares the frame-sync count with its own snapshot, and the wait is
+ * bounded by two frame periods.
+ */
+static void xvip_wait_frame_sync(struct xvip_composite_device *xdev)
+{
+	unsigned int seq;
+
+	if (!xdev->is_streaming)
+		return;
+
+	seq = atomic_read(&xdev->frame_seq);
+	if (!wait_event_timeout(xdev->frame_wq,
+				atomic_read(&xdev->frame_seq) != seq,
+				xvip_frame_sync_timeout(xdev)))
+		dev_dbg(xdev->dev, "no frame sync, applying controls\n");
+}
+
+/**
+ * xvip_ctrl_batch_apply - Apply a set of control changes together
+ * @xdev: Composite video device
+ * @updates: the control changes
+ * @count: number of entries in @updates
+ *
+ * When streaming, wait for the next frame-sync event, or at most two frame
+ * periods, then write the controls with the group hold asserted. Must be
+ * called with the device lock held.
+ *
+ * Return: 0 on success or the first error returned by a control
+ */
+static int xvip_ctrl_batch_apply(struct xvip_composite_device *xdev,
+				 const struct xvip_ctrl_update *updates,
+				 unsigned int count)
+{
+	unsigned int i;
+	int ret = 0;
+	int err;
+
+	if (!count)
+		return 0;
+
+	xvip_wait_frame_sync(xdev);
+
+	xvip_ctrl_batch_hold(xdev, updates, count, true);
+
+	for (i = 0; i < count; i++) {
+		err = xvip_ctrl_set(updates[i].ctrl, updates[i].value);
+		if (err < 0) {
+			dev_err(xdev->dev, "failed to set control %s of %s\n",
+				updates[i].ctrl->name,
+				updates[i].entity->entity->name);
+			if (!ret)
+				ret = err;
+		}
+	}
+
+	xvip_ctrl_batch_hold(xdev, updates, count, false);
+
+	return ret;
+}
+
+/*
+ * Parse one "<entity> <control id> <value>" line of a batch into @update.
+ */
+static int xvip_ctrl_update_parse(struct xvip_composite_device *xdev,
+				  char *line, struct xvip_ctrl_update *update)
+{
+	char *name, *id, *value;
+	u32 cid;
+	int ret;
+
+	name = xvip_next_token(&line);
+	id = xvip_next_token(&line);
+	value = xvip_next_token(&line);
+	if (!name || !id || !value || xvip_next_token(&line))
+		return -EINVAL;
+
+	update->entity = xvip_graph_find_entity_by_name(xdev, name);
+	if (!update->entity || !update->entity->subdev->ctrl_handler)
+		return -ENODEV;
+
+	ret = kstrtou32(id, 0, &cid);
+	if (ret < 0)
+		return ret;
+
+	ret = kstrtos64(value, 0, &update->value);
+	if (ret < 0)
+		return ret;
+
+	update->ctrl = v4l2_ctrl_find(update->entity->subdev->ctrl_handler,
+				      cid);
+	if (!update->ctrl)
+		return -ENOENT;
+
+	return xvip_ctrl_check(update->ctrl, update->value);
+}
+
+/* -----------------------------------------------------------------------------
+ * Connected Components
+ *
+ * The adjacency of the entities through enabled links, the connected
+ * components of the graph and the downstream chain of every source entity are
+ * computed once all subdevs are bound and again after link changes. They are
+ * stored as arrays of entity ids, so that operations on a pipeline only visit
+ * its own entities, linearly in memory.
+ */
+
+static bool xvip_entity_is_source(struct media_entity *entity)
+{
+	unsigned int i;
+
+	for (i = 0; i < entity->num_pads; i++)
+		if (entity->pads[i].flags & MEDIA_PAD_FL_SINK)
+			return false;
+
+	return true;
+}
+
+static inline unsigned int xvip_entity_id(struct xvip_composite_device *xdev,
+					  const struct xvip_graph_entity *entity)
+{
+	return entity - xdev->entities;
+}
+
+/*
+ * Return the entity fed by @link if it is an enabled data link leaving @entity
+ * towards one of our subdevs, NULL otherwise.
+ */
+static struct xvip_graph_entity *xvip_link_sink(struct media_link *link,
+						struct media_entity *entity)
+{
+	if ((link->flags & MEDIA_LNK_FL_LINK_TYPE) != MEDIA_LNK_FL_DATA_LINK ||
+	    !(link->flags & MEDIA_LNK_FL_ENABLED) ||
+	    link->source->entity != entity)
+		return NULL;
+
+	return xvip_entity_from_media(link->sink->entity);
+}
+
+/* Build the successor lists, must be called with the graph mutex held. */
+static int xvip_adjacency_build(struct xvip_composite_device *xdev)
+{
+	unsigned int n = xdev->num_subdevs;
+	struct xvip_graph_entity *sink;
+	struct media_entity *entity;
+	struct media_link *link;
+	unsigned int *offsets;
+	unsigned int *successors;
+	unsigned int i, k;
+
+	offsets = kcalloc(n + 1, sizeof(*offsets), GFP_KERNEL);
+	if (!offsets)
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++) {
+		entity = xdev->entities[i].entity;
+		offsets[i + 1] = offsets[i];
+		list_for_each_entry(link, &entity->links, list)
+			if (xvip_link_sink(link, entity))
+				offsets[i + 1]++;
+	}
+
+	successors = kcalloc(offsets[n], sizeof(*successors), GFP_KERNEL);
+	if (!successors) {
+		kfree(offsets);
+		return -ENOMEM;
+	}
+
+	for (i = 0, k = 0; i < n; i++) {
+		entity = xdev->entities[i].entity;
+		list_for_each_entry(link, &entity->links, list) {
+			sink = xvip_link_sink(link, entity);
+			if (sink)
+				successors[k++] = xvip_entity_id(xdev, sink);
+		}
+	}
+
+	xdev->successor_offsets = offsets;
+	xdev->successors = successors;
+
+	return 0;
+}
+
+static unsigned int xvip_uf_find(unsigned int *parent, unsigned int i)
+{
+	while (parent[i] != i) {
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+
+	return i;
+}
+
+/* Assign every entity to a component, components with a source first. */
+static void xvip_components_assign(struct xvip_composite_device *xdev,
+				   unsigned int *parent, unsigned int *root_comp)
+{
+	struct xvip_component *component;
+	struct xvip_graph_entity *entity;
+	unsigned int n = xdev->num_subdevs;
+	unsigned int i, k, root, pass;
+
+	for (i = 0; i < n; i++) {
+		parent[i] = i;
+		root_comp[i] = UINT_MAX;
+	}
+
+	for (i = 0; i < n; i++)
+		for (k = xdev->successor_offsets[i];
+		     k < xdev->successor_offsets[i + 1]; k++)
+			parent[xvip_uf_find(parent, i)] =
+				xvip_uf_find(parent, xdev->successors[k]);
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < n; i++) {
+			entity = &xdev->entities[i];
+			if (!pass != xvip_entity_is_source(entity->entity))
+				continue;
+
+			root = xvip_uf_find(parent, i);
+			if (root_comp[root] == UINT_MAX) {
+				root_comp[root] = xdev->num_components++;
+				component = &xdev->components[root_comp[root]];
+				component->source = pass ? XVIP_NO_ENTITY : i;
+			}
+
+			entity->component = root_comp[root];
+			xdev->components[entity->component].num_entities++;
+		}
+	}
+}
+
+/*
+ * Fill the start order with the entities of each component, sources first and
+ * every entity after the ones feeding it (Kahn's algorithm). Entities in a
+ * loop, if any, are appended in id order.
+ */
+static void xvip_components_order(struct xvip_composite_device *xdev,
+				  unsigned int *indegree, unsigned int *queue,
+				  unsigned int *cursor)
+{
+	unsigned int n = xdev->num_subdevs;
+	unsigned int head = 0, tail = 0;
+	unsigned int i, k, first, id;
+
+	for (i = 0, first = 0; i < xdev->num_components; i++) {
+		xdev->components[i].first = first;
+		cursor[i] = first;
+		first += xdev->components[i].num_entities;
+	}
+
+	memset(indegree, 0, n * sizeof(*indegree));
+	for (k = 0; k < xdev->successor_offsets[n]; k++)
+		indegree[xdev->successors[k]]++;
+
+	for (i = 0; i < n; i++)
+		if (!indegree[i])
+			queue[tail++] = i;
+
+	while (head < tail) {
+		id = queue[head++];
+		for (k = xdev->successor_offsets[id];
+		     k < xdev->successor_offsets[id + 1]; k++)
+			if (!--indegree[xdev->successors[k]])
+				queue[tail++] = xdev->successors[k];
+	}
+
+	for (i = 0; i < n && tail < n; i++)
+		if (indegree[i])
+			queue[tail++] = i;
+
+	for (i = 0; i < n; i++) {
+		id = queue[i];
+		xdev->start_order[cursor[xdev->entities[id].component]++] = id;
+	}
+}
+
+/* Breadth-first walk of the successors of @source into @chain. */
+static unsigned int xvip_downstream_walk(struct xvip_composite_device *xdev,
+					 unsigned int source,
+					 unsigned int *chain)
+{
+	unsigned int count = 1;
+	unsigned int i, j, k;
+	unsigned int sink;
+
+	chain[0] = source;
+
+	for (i = 0; i < count; i++) {
+		for (k = xdev->successor_offsets[chain[i]];
+		     k < xdev->successor_offsets[chain[i] + 1]; k++) {
+			sink = xdev->successors[k];
+
+			for (j = 0; j < count; j++)
+				if (chain[j] == sink)
+					break;
+			if (j == count)
+				chain[count++] = sink;
+		}
+	}
+
+	return count;
+}
+
+static void xvip_components_free(struct xvip_composite_device *xdev)
+{
+	kfree(xdev->components);
+	kfree(xdev->start_order);
+	kfree(xdev->successor_offsets);
+	kfree(xdev->successors);
+	kfree(xdev->downstream_ids);
+	xdev->components = NULL;
+	xdev->start_order = NULL;
+	xdev->successor_offsets = NULL;
+	xdev->successors = NULL;
+	xdev->downstream_ids = NULL;
+	xdev->num_components = 0;
+	xdev->components_gen = 0;
+}
+
+/**
+ * xvip_components_update - Recompute the connected components if needed
+ * @xdev: Composite video device
+ *
+ * Must be called with the device lock held.
+ *
+ * Return: 0 on success or a negative error code
+ */
+static int xvip_components_update(struct xvip_composite_device *xdev)
+{
+	unsigned int gen = atomic_read(&xdev->config_gen);
+	unsigned int n = xdev->num_subdevs;
+	struct xvip_graph_entity *entity;
+	unsigned int num_sources = 0;
+	unsigned int *downstream;
+	unsigned int *scratch;
+	unsigned int i;
+	int ret;
+
+	if (xdev->components_gen == gen)
+		return 0;
+
+	xvip_components_free(xdev);
+
+	if (!n)
+		return -ENODEV;
+
+	for (i = 0; i < n; i++) {
+		entity = &xdev->entities[i];
+		entity->downstream = NULL;
+		entity->num_downstream = 0;
+		if (xvip_entity_is_source(entity->entity))
+			num_sources++;
+	}
+
+	mutex_lock(&xdev->media_dev.graph_mutex);
+	ret = xvip_adjacency_build(xdev);
+	mutex_unlock(&xdev->media_dev.graph_mutex);
+	if (ret < 0)
+		return ret;
+
+	xdev->components = kcalloc(n, sizeof(*xdev->components), GFP_KERNEL);
+	xdev->start_order = kcalloc(n, sizeof(*xdev->start_order), GFP_KERNEL);
+	xdev->downstream_ids = kcalloc(num_sources * n,
+				       sizeof(*xdev->downstream_ids),
+				       GFP_KERNEL);
+	scratch = kcalloc(3 * n, sizeof(*scratch), GFP_KERNEL);
+	if (!xdev->components || !xdev->start_order ||
+	    !xdev->downstream_ids || !scratch) {
+		kfree(scratch);
+		xvip_components_free(xdev);
+		return -ENOMEM;
+	}
+
+	xvip_components_assign(xdev, scratch, scratch + n);
+	xvip_components_order(xdev, scratch, scratch + n, scratch + 2 * n);
+	kfree(scratch);
+
+	downstream = xdev->downstream_ids;
+	for (i = 0; i < n; i++) {
+		entity = &xdev->entities[i];
+		if (!xvip_entity_is_source(entity->entity))
+			continue;
+
+		entity->downstream = downstream;
+		entity->num_downstream = xvip_downstream_walk(xdev, i,
+							      downstream);
+		downstream += n;
+	}
+
+	xdev->components_gen = gen;
+
+	dev_dbg(xdev->dev, "%u connected components\n", xdev->num_components);
+
+	return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Pipeline Validation
+ *
+ * The links of the pipeline are validated once all subdevs are bound and again
+ * after every format or link change made through the driver or the media
+ * device, and the result is cached for the next start. Formats can also be
+ * changed directly on the subdev nodes without the driver being told, so the
+ * cache is also keyed by a fingerprint of the active formats of all pads, and
+ * a V4L2_EVENT_SOURCE_CHANGE event from a subdev invalidates it.
+ */
+
+/*
+ * Hash the active format of every pad of every subdev. Pads without a format
+ * are skipped. Must be called with the device lock held.
+ */
+static u32 xvip_format_fingerprint(struct xvip_composite_device *xdev)
+{
+	struct v4l2_subdev_format fmt = { .which = V4L2_SUBDEV_FORMAT_ACTIVE };
+	struct xvip_graph_entity *entity;
+	u32 crc = ~0;
+	unsigned int i, j;
+
+	for (i = 0; i < xdev->num_subdevs; i++) {
+		entity = &xdev->entities[i];
+
+		for (j = 0; j < entity->entity->num_pads; j++) {
+			fmt.pad = j;
+			if (v4l2_subdev_call(entity->subdev, pad, get_fmt, NULL,
+					     &fmt) < 0)
+				continue;
+
+			crc = crc32_le(crc, (const u8 *)&fmt.pad,
+				       sizeof(fmt.pad));
+			crc = crc32_le(crc, (const u8 *)&fmt.format,
+				       sizeof(fmt.format));
+		}
+	}
+
+	return ~crc;
+}
+
+/**
+ * xvip_pipeline_validate - Validate the links of the pipeline
+ * @xdev: Composite video device
+ *
+ * Run link validation from the source of every connected component, unless
+ * neither the configuration generation nor the active formats changed since
+ * the last validation. Must be called with the device lock held.
+ *
+ * Return: 0 if the pipeline is valid or a negative error code
+ */
+static int xvip_pipeline_validate(struct xvip_composite_device *xdev)
+{
+	unsigned int gen = atomic_read(&xdev->config_gen);
+	u32 fingerprint = xvip_format_fingerprint(xdev);
+	struct xvip_graph_entity *entity;
+	unsigned int i;
+	int ret;
+
+	if (xdev->validated_gen == gen && xdev->validated_fmt == fingerprint)
+		return xdev->validation_result;
+
+	ret = xvip_components_update(xdev);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < xdev->num_components; i++) {
+		if (xdev->components[i].source == XVIP_NO_ENTITY)
+			continue;
+
+		entity = &xdev->entities[xdev->components[i].source];
+
+		ret = media_pipeline_start(entity->entity, &xdev->pipe);
+		if (ret < 0) {
+			dev_err(xdev->dev, "pipeline from %s is invalid (%d)\n",
+				entity->entity->name, ret);
+			break;
+		}
+		media_pipeline_stop(entity->entity);
+	}
+
+	xdev->validated_gen = gen;
+	xdev->validated_fmt = fingerprint;
+	xdev->validation_result = ret;
+
+	return ret;
+}
+
+/**
+ * xvip_topology_uevent - Notify userspace of the state of the media device
+ * @xdev: Composite video device
+ * @state: "ready" when the media device is registered, "changed" after a
+ *	link change, "incomplete" when a subdev goes away
+ *
+ * Send a change uevent on the composite device carrying the media device node
+ * name, the number of entities and the configuration and topology generations,
+ * so that userspace can open the nodes without polling for them.
+ */
+static void xvip_topology_uevent(struct xvip_composite_device *xdev,
+				 const char *state)
+{
+	struct media_devnode *devnode = xdev->media_dev.devnode;
+	char *envp[6] = { NULL };
+	unsigned int i = 0;
+
+	if (!devnode || !media_devnode_is_registered(devnode))
+		return;
+
+	envp[i++] = kasprintf(GFP_KERNEL, "MEDIACTL_STATE=%s", state);
+	envp[i++] = kasprintf(GFP_KERNEL, "MEDIA_DEVICE=%s",
+			      dev_name(&devnode->dev));
+	envp[i++] = kasprintf(GFP_KERNEL, "MEDIACTL_ENTITIES=%u",
+			      xdev->num_subdevs);
+	envp[i++] = kasprintf(GFP_KERNEL, "MEDIACTL_GENERATION=%u",
+			      atomic_read(&xdev->config_gen));
+	envp[i++] = kasprintf(GFP_KERNEL, "MEDIACTL_TOPOLOGY_VERSION=%llu",
+			      xdev->media_dev.topology_version);
+
+	for (i = 0; i < ARRAY_SIZE(envp) - 1; i++)
+		if (!envp[i])
+			goto done;
+
+	kobject_uevent_env(&xdev->dev->kobj, KOBJ_CHANGE, envp);
+
+done:
+	for (i = 0; i < ARRAY_SIZE(envp) - 1; i++)
+		kfree(envp[i]);
+}
+
+static void xvip_pipeline_validate_work(struct work_struct *work)
+{
+	struct xvip_composite_device *xdev =
+		container_of(work, struct xvip_composite_device, validate_work);
+
+	mutex_lock(&xdev->lock);
+	xvip_pipeline_validate(xdev);
+	mutex_unlock(&xdev->lock);
+
+	xvip_topology_uevent(xdev, "changed");
+}
+
+/* Called by the media core with the graph mutex held. */
+static int xvip_link_notify(struct media_link *link, u32 flags,
+			    unsigned int notification)
+{
+	struct xvip_composite_device *xdev =
+		container_of(link->graph_obj.mdev,
+			     struct xvip_composite_device, media_dev);
+
+	if (notification == MEDIA_DEV_NOTIFY_POST_LINK_CH) {
+		atomic_inc(&xdev->config_gen);
+		schedule_work(&xdev->validate_work);
+	}
+
+	return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Media Requests
+ *
+ * Userspace binds control values of any number of subdevs to a request through
+ * VIDIOC_S_EXT_CTRLS on the subdev nodes, then queues it on the media device.
+ * Requests are applied in queueing order, one per frame while streaming, the
+ * same way as control batches.
+ */
+
+static inline struct xvip_request *to_xvip_request(struct media_request *req)
+{
+	return container_of(req, struct xvip_request, req);
+}
+
+static struct media_request *xvip_request_alloc(struct media_device *mdev)
+{
+	struct xvip_request *xreq;
+
+	xreq = kzalloc(sizeof(*xreq), GFP_KERNEL);
+	if (!xreq)
+		return NULL;
+
+	return &xreq->req;
+}
+
+static void xvip_request_free(struct media_request *req)
+{
+	kfree(to_xvip_request(req));
+}
+
+static int xvip_request_validate(struct media_request *req)
+{
+	/* Only control handlers can be bound to the request. */
+	if (list_empty(&req->objects))
+		return -ENOENT;
+
+	return 0;
+}
+
+static void xvip_request_queue(struct media_request *req)
+{
+	struct xvip_composite_device *xdev =
+		container_of(req->mdev, struct xvip_composite_device,
+			     media_dev);
+	struct xvip_request *xreq = to_xvip_request(req);
+	struct media_request_object *obj, *obj_safe;
+
+	list_for_each_entry_safe(obj, obj_safe, &req->objects, list)
+		if (obj->ops->queue)
+			obj->ops->queue(obj);
+
+	media_request_get(req);
+
+	spin_lock(&xdev->requests_lock);
+	list_add_tail(&xreq->list, &xdev->requests);
+	spin_unlock(&xdev->requests_lock);
+
+	schedule_work(&xdev->request_work);
+}
+
+static const struct media_device_ops xvip_media_ops = {
+	.req_alloc = xvip_request_alloc,
+	.req_free = xvip_request_free,
+	.req_validate = xvip_request_validate,
+	.req_queue = xvip_request_queue,
+	.link_notify = xvip_link_notify,
+};
+
+static bool xvip_request_uses(struct media_request *req,
+			      struct xvip_graph_entity *entity)
+{
+	struct v4l2_ctrl_handler *hdl;
+
+	if (!entity->subdev || !entity->subdev->ctrl_handler)
+		return false;
+
+	hdl = v4l2_ctrl_request_hdl_find(req, entity->subdev->ctrl_handler);
+	if (!hdl)
+		return false;
+
+	v4l2_ctrl_request_hdl_put(hdl);
+	return true;
+}
+
+static void xvip_request_apply(struct xvip_composite_device *xdev,
+			       struct media_request *req)
+{
+	struct xvip_graph_entity *entity;
+	struct v4l2_ctrl *hold;
+	unsigned int i;
+	int ret;
+
+	xvip_wait_frame_sync(xdev);
+
+	/*
+	 * The handlers can't be looked up once the request starts completing,
+	 * remember which entities it uses.
+	 */
+	for (i = 0; i < xdev->num_subdevs; i++) {
+		entity = &xdev->entities[i];
+		entity->in_request = xvip_request_uses(req, entity);
+		if (!entity->in_request)
+			continue;
+
+		hold = xvip_entity_group_hold(xdev, entity);
+		if (hold)
+			v4l2_ctrl_s_ctrl(hold, 1);
+
+		ret = v4l2_ctrl_request_setup(req,
+					      entity->subdev->ctrl_handler);
+		if (ret < 0)
+			dev_err(xdev->dev, "failed to apply request to %s\n",
+				entity->entity->name);
+	}
+
+	for (i = 0; i < xdev->num_subdevs; i++) {
+		entity = &xdev->entities[i];
+		if (!entity->in_request)
+			continue;
+
+		entity->in_request = false;
+
+		hold = xvip_entity_group_hold(xdev, entity);
+		if (hold)
+			v4l2_ctrl_s_ctrl(hold, 0);
+
+		v4l2_ctrl_request_complete(req, entity->subdev->ctrl_handler);
+	}
+}
+
+static void xvip_request_work(struct work_struct *work)
+{
+	struct xvip_composite_device *xdev =
+		container_of(work, struct xvip_composite_device, request_work);
+	struct xvip_request *xreq;
+
+	while (1) {
+		spin_lock(&xdev->requests_lock);
+		xreq = list_first_entry_or_null(&xdev->requests,
+						struct xvip_request, list);
+		if (xreq)
+			list_del(&xreq->list);
+		spin_unlock(&xdev->requests_lock);
+
+		if (!xreq)
+			break;
+
+		mutex_lock(&xdev->lock);
+		xvip_request_apply(xdev, &xreq->req);
+		xdev->active_profile = NULL;
+		mutex_unlock(&xdev->lock);
+
+		media_request_put(&xreq->req);
+	}
+}
+
+/* -----------------------------------------------------------------------------
+ * Reconfiguration
+ *
+ * A configuration lists target formats, frame intervals and control values,
+ * one per line:
+ *
+ *	<entity> fmt <pad> <width>x<height> <media bus code>
+ *	<entity> interval <numerator>/<denominator>
+ *	<entity> ctrl <control id> <value>
+ *	<entity> link <source pad> <sink entity> <sink pad> <0|1>
+ *
+ * Reconfiguring only touches the settings that differ from the current state.
+ * Controls and, where the subdev allows it, frame intervals are changed on the
+ * fly; only the subdevs whose format or outgoing links change are stopped and
+ * restarted.
+ */
+
+static bool xvip_fract_equal(const struct v4l2_fract *a,
+			     const struct v4l2_fract *b)
+{
+	return (u64)a->numerator * b->denominator ==
+	       (u64)b->numerator * a->denominator;
+}
+
+static int xvip_setting_parse(struct xvip_composite_device *xdev, char *line,
+			      struct xvip_setting *setting)
+{
+	struct v4l2_mbus_framefmt *fmt = &setting->format.format;
+	struct xvip_graph_entity *sink;
+	unsigned int source_pad, sink_pad;
+	unsigned int num_args = 0;
+	char *name, *type, *arg;
+	char *args[4];
+	bool enable;
+	u32 cid;
+	int ret;
+
+	name = xvip_next_token(&line);
+	type = xvip_next_token(&line);
+	if (!name || !type)
+		return -EINVAL;
+
+	while ((arg = xvip_next_token(&line)) != NULL) {
+		if (num_args == ARRAY_SIZE(args))
+			return -EINVAL;
+		args[num_args++] = arg;
+	}
+
+	setting->entity = xvip_graph_find_entity_by_name(xdev, name);
+	if (!setting->entity)
+		return -ENODEV;
+
+	if (!strcmp(type, "fmt")) {
+		setting->type = XVIP_SETTING_FORMAT;
+		setting->format.which = V4L2_SUBDEV_FORMAT_ACTIVE;
+
+		if (num_args != 3)
+			return -EINVAL;
+		ret = kstrtou32(args[0], 0, &setting->format.pad);
+		if (ret < 0)
+			return ret;
+		if (setting->format.pad >= setting->entity->entity->num_pads)
+			return -EINVAL;
+		if (sscanf(args[1], "%ux%u", &fmt->width, &fmt->height) != 2)
+			return -EINVAL;
+		return kstrtou32(args[2], 0, &fmt->code);
+	}
+
+	if (!strcmp(type, "interval")) {
+		setting->type = XVIP_SETTING_INTERVAL;
+
+		if (num_args != 1)
+			return -EINVAL;
+		if (sscanf(args[0], "%u/%u", &setting->interval.numerator,
+			   &setting->interval.denominator) != 2 ||
+		    !setting->interval.numerator ||
+		    !setting->interval.denominator)
+			return -EINVAL;
+		return 0;
+	}
+
+	if (!strcmp(type, "ctrl")) {
+		setting->type = XVIP_SETTING_CTRL;
+
+		if (num_args != 2 || !setting->entity->subdev->ctrl_handler)
+			return -EINVAL;
+		ret = kstrtou32(args[0], 0, &cid);
+		if (ret < 0)
+			return ret;
+		ret = kstrtos64(args[1], 0, &setting->value);
+		if (ret < 0)
+			return ret;
+		setting->ctrl = v4l2_ctrl_find(setting->entity->subdev->ctrl_handler,
+					       cid);
+		if (!setting->ctrl)
+			return -ENOENT;
+		return xvip_ctrl_check(setting->ctrl, setting->value);
+	}
+
+	if (!strcmp(type, "link")) {
+		setting->type = XVIP_SETTING_LINK;
+
+		if (num_args != 4)
+			return -EINVAL;
+		sink = xvip_graph_find_entity_by_name(xdev, args[1]);
+		if (!sink)
+			return -ENODEV;
+		if (kstrtouint(args[0], 0, &source_pad) < 0 ||
+		    kstrtouint(args[2], 0, &sink_pad) < 0 ||
+		    kstrtobool(args[3], &enable) < 0)
+			return -EINVAL;
+		if (source_pad >= setting->entity->entity->num_pads ||
+		    sink_pad >= sink->entity->num_pads)
+			return -EINVAL;
+
+		setting->link = media_entity_find_link(
+					&setting->entity->entity->pads[source_pad],
+					&sink->entity->pads[sink_pad]);
+		if (!setting->link)
+			return -ENOENT;
+		if (setting->link->flags & MEDIA_LNK_FL_IMMUTABLE)
+			return -EPERM;
+		setting->enable = enable;
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+/**
+ * xvip_config_parse - Parse a textual pipeline configuration
+ * @xdev: Composite video device
+ * @buf: the configuration, one setting per line
+ * @len: length of @buf
+ *
+ * Return: the configuration, to be freed with kfree(), or an ERR_PTR()
+ */
+static struct xvip_config *xvip_config_parse(struct xvip_composite_device *xdev,
+					     const char *buf, size_t len)
+{
+	struct xvip_config *cfg;
+	unsigned int max_settings = 1;
+	char *lines, *pos, *line;
+	int ret = 0;
+
+	lines = kstrndup(buf, len, GFP_KERNEL);
+	if (!lines)
+		return ERR_PTR(-ENOMEM);
+
+	for (pos = lines; *pos; pos++)
+		if (*pos == '\n')
+			max_settings++;
+
+	cfg = kzalloc(struct_size(cfg, settings, max_settings), GFP_KERNEL);
+	if (!cfg) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	pos = lines;
+	while ((line = strsep(&pos, "\n")) != NULL) {
+		if (!*skip_spaces(line))
+			continue;
+
+		ret = xvip_setting_parse(xdev, line,
+					 &cfg->settings[cfg->count]);
+		if (ret < 0) {
+			dev_dbg(xdev->dev, "invalid setting '%s'\n", line);
+			break;
+		}
+		cfg->count++;
+	}
+
+done:
+	kfree(lines);
+	if (ret < 0) {
+		kfree(cfg);
+		return ERR_PTR(ret);
+	}
+
+	return cfg;
+}
+
+/* Return true if the setting differs from the current state of the subdev. */
+static bool xvip_setting_differs(const struct xvip_setting *setting)
+{
+	struct v4l2_subdev *subdev = setting->entity->subdev;
+	struct v4l2_subdev_frame_interval ival = { .pad = 0 };
+	struct v4l2_subdev_format fmt = {
+		.which = V4L2_SUBDEV_FORMAT_ACTIVE,
+		.pad = setting->format.pad,
+	};
+	int ret;
+
+	switch (setting->type) {
+	case XVIP_SETTING_FORMAT:
+		ret = v4l2_subdev_call(subdev, pad, get_fmt, NULL, &fmt);
+		return ret < 0 ||
+		       fmt.format.width != setting->format.format.width ||
+		       fmt.format.height != setting->format.format.height ||
+		       fmt.format.code != setting->format.format.code;
+
+	case XVIP_SETTING_INTERVAL:
+		ret = v4l2_subdev_call(subdev, video, g_frame_interval, &ival);
+		return ret < 0 ||
+		       !xvip_fract_equal(&ival.interval, &setting->interval);
+
+	case XVIP_SETTING_CTRL:
+		if (setting->ctrl->type == V4L2_CTRL_TYPE_INTEGER64)
+			return v4l2_ctrl_g_ctrl_int64(setting->ctrl) !=
+			       setting->value;
+		return v4l2_ctrl_g_ctrl(setting->ctrl) != setting->value;
+
+	case XVIP_SETTING_LINK:
+		return !!(setting->link->flags & MEDIA_LNK_FL_ENABLED) !=
+		       setting->enable;
+	}
+
+	return true;
+}
+
+static int xvip_setting_apply(struct xvip_composite_device *xdev,
+			      const struct xvip_setting *setting)
+{
+	struct xvip_graph_entity *entity = setting->entity;
+	struct v4l2_subdev_frame_interval ival = {
+		.pad = 0,
+		.interval = setting->interval,
+	};
+	struct v4l2_subdev_format fmt;
+	int ret;
+
+	switch (setting->type) {
+	case XVIP_SETTING_FORMAT:
+		fmt = setting->format;
+		ret = v4l2_subdev_call(entity->subdev, pad, set_fmt, NULL, &fmt);
+		if (ret < 0)
+			return ret;
+		if (fmt.format.width != setting->format.format.width ||
+		    fmt.format.height != setting->format.format.height ||
+		    fmt.format.code != setting->format.format.code)
+			dev_warn(xdev->dev, "%s:%u format adjusted to %ux%u 0x%04x\n",
+				 entity->entity->name, fmt.pad,
+				 fmt.format.width, fmt.format.height,
+				 fmt.format.code);
+		return 0;
+
+	case XVIP_SETTING_INTERVAL:
+		ret = v4l2_subdev_call(entity->subdev, video, s_frame_interval,
+				       &ival);
+		if (ret < 0)
+			return ret;
+		entity->interval_configured = true;
+		return 0;
+
+	case XVIP_SETTING_CTRL:
+		return xvip_ctrl_set(setting->ctrl, setting->value);
+
+	case XVIP_SETTING_LINK:
+		return media_entity_setup_link(setting->link, setting->enable ?
+					       MEDIA_LNK_FL_ENABLED : 0);
+	}
+
+	return -EINVAL;
+}
+
+static u64 xvip_gap_frames(ktime_t gap, const struct v4l2_fract *interval)
+{
+	if (!interval->numerator)
+		return 0;
+
+	return div64_u64(ktime_to_ns(gap) * interval->denominator +
+			 (u64)interval->numerator * NSEC_PER_SEC - 1,
+			 (u64)interval->numerator * NSEC_PER_SEC);
+}
+
+/**
+ * xvip_reconfigure - Switch the pipeline to a new configuration
+ * @xdev: Composite video device
+ * @cfg: the target configuration
+ *
+ * Apply the settings of @cfg that differ from the current state of the
+ * subdevs, stopping only the streaming subdevs that can't take the change on
+ * the fly. The number of changes and the resulting stream interruption are
+ * recorded in @xdev. Must be called with the device lock held.
+ *
+ * Return: 0 on success or a negative error code
+ */
+static int xvip_reconfigure(struct xvip_composite_device *xdev,
+			    const struct xvip_config *cfg)
+{
+	struct xvip_graph_entity **restart;
+	struct xvip_ctrl_update *ctrls;
+	const struct v4l2_fract *interval = NULL;
+	unsigned int num_restart = 0;
+	unsigned int num_ctrls = 0;
+	unsigned int num_changes = 0;
+	ktime_t start;
+	ktime_t gap = 0;
+	bool *deferred;
+	unsigned int i, j;
+	int ret = 0;
+	int err;
+
+	/* The media core doesn't allow link changes on a streaming pipeline. */
+	for (i = 0; i < cfg->count; i++) {
+		const struct xvip_setting *setting = &cfg->settings[i];
+
+		if (setting->type == XVIP_SETTING_LINK &&
+		    xvip_setting_differs(setting) &&
+		    (setting->link->source->entity->pipe ||
+		     setting->link->sink->entity->pipe))
+			return -EBUSY;
+	}
+
+	restart = kcalloc(cfg->count, sizeof(*restart), GFP_KERNEL);
+	ctrls = kcalloc(cfg->count, sizeof(*ctrls), GFP_KERNEL);
+	deferred = kcalloc(cfg->count, sizeof(*deferred), GFP_KERNEL);
+	if (!restart || !ctrls || !deferred) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	for (i = 0; i < cfg->count; i++) {
+		const struct xvip_setting *setting = &cfg->settings[i];
+		struct xvip_graph_entity *entity = setting->entity;
+
+		if (!xvip_setting_differs(setting))
+			continue;
+
+		num_changes++;
+
+		if (setting->type == XVIP_SETTING_CTRL) {
+			ctrls[num_ctrls].entity = entity;
+			ctrls[num_ctrls].ctrl = setting->ctrl;
+			ctrls[num_ctrls].value = setting->value;
+			num_ctrls++;
+			continue;
+		}
+
+		if (!entity->streaming) {
+			ret = xvip_setting_apply(xdev, setting);
+			if (ret < 0)
+				goto done;
+			continue;
+		}
+
+		/* Try to change the frame interval while streaming. */
+		if (setting->type == XVIP_SETTING_INTERVAL) {
+			ret = xvip_setting_apply(xdev, setting);
+			if (ret != -EBUSY) {
+				if (ret < 0)
+					goto done;
+				continue;
+			}
+		}
+
+		deferred[i] = true;
+		for (j = 0; j < num_restart; j++)
+			if (restart[j] == entity)
+				break;
+		if (j == num_restart)
+			restart[num_restart++] = entity;
+	}
+
+	if (num_restart) {
+		start = ktime_get();
+
+		for (i = 0; i < num_restart; i++)
+			xvip_entity_start_stop(xdev, restart[i], false);
+
+		/*
+		 * Apply all deferred settings and restart all subdevs even if
+		 * one fails, and report the first error.
+		 */
+		for (i = 0; i < cfg->count; i++) {
+			if (!deferred[i])
+				continue;
+			err = xvip_setting_apply(xdev, &cfg->settings[i]);
+			if (err < 0) {
+				dev_err(xdev->dev, "failed to reconfigure %s\n",
+					cfg->settings[i].entity->entity->name);
+				if (!ret)
+					ret = err;
+			}
+		}
+
+		for (i = 0; i < num_restart; i++) {
+			err = xvip_entity_start_stop(xdev, restart[i], true);
+			if (err < 0) {
+				dev_err(xdev->dev, "failed to restart %s\n",
+					restart[i]->entity->name);
+				if (!ret)
+					ret = err;
+			}
+			if (!interval && restart[i]->interval.numerator)
+				interval = &restart[i]->interval;
+		}
+
+		gap = ktime_sub(ktime_get(), start);
+	}
+
+	if (num_ctrls) {
+		err = xvip_ctrl_batch_apply(xdev, ctrls, num_ctrls);
+		if (err < 0 && !ret)
+			ret = err;
+	}
+
+	xdev->reconfig_changes = num_changes;
+	xdev->reconfig_gap = gap;
+	xdev->reconfig_gap_frames = interval ? xvip_gap_frames(gap, interval) : 0;
+
+	if (num_changes > num_ctrls) {
+		atomic_inc(&xdev->config_gen);
+		xvip_pipeline_validate(xdev);
+	}
+
+	dev_dbg(xdev->dev, "reconfigured %u settings, %u subdevs restarted\n",
+		num_changes, num_restart);
+
+done:
+	kfree(deferred);
+	kfree(ctrls);
+	kfree(restart);
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * Profiles
+ *
+ * Profiles are named configurations, defined in the "profiles" child node of
+ * the device tree node (one child per profile, with the settings as a string
+ * list in its "settings" property) or uploaded at runtime. Formats are checked
+ * against the subdevs once when the profile is defined. As the subdevs can also
+ * be configured through their own nodes, switching profiles compares every
+ * setting with the current state of the subdevs and only applies the ones that
+ * differ.
+ */
+
+static int xvip_config_validate(struct xvip_composite_device *xdev,
+				const struct xvip_config *cfg)
+{
+	const struct xvip_setting *setting;
+	struct v4l2_subdev_pad_config *pad_cfg;
+	struct v4l2_subdev_format fmt;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < cfg->count; i++) {
+		setting = &cfg->settings[i];
+		if (setting->type != XVIP_SETTING_FORMAT)
+			continue;
+
+		pad_cfg = v4l2_subdev_alloc_pad_config(setting->entity->subdev);
+		if (!pad_cfg)
+			return -ENOMEM;
+
+		fmt = setting->format;
+		fmt.which = V4L2_SUBDEV_FORMAT_TRY;
+		ret = v4l2_subdev_call(setting->entity->subdev, pad, set_fmt,
+				       pad_cfg, &fmt);
+		v4l2_subdev_free_pad_config(pad_cfg);
+		if (ret < 0)
+			return ret;
+
+		if (fmt.format.width != setting->format.format.width ||
+		    fmt.format.height != setting->format.format.height ||
+		    fmt.format.code != setting->format.format.code) {
+			dev_err(xdev->dev, "%s:%u doesn't support %ux%u 0x%04x\n",
+				setting->entity->entity->name, fmt.pad,
+				setting->format.format.width,
+				setting->format.format.height,
+				setting->format.format.code);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static struct xvip_profile *
+xvip_profile_find(struct xvip_composite_device *xdev, const char *name)
+{
+	struct xvip_profile *profile;
+
+	list_for_each_entry(profile, &xdev->profiles, list)
+		if (!strcmp(profile->name, name))
+			return profile;
+
+	return NULL;
+}
+
+static void xvip_profile_free(struct xvip_profile *profile)
+{
+	kfree(profile->cfg);
+	kfree(profile->name);
+	kfree(profile);
+}
+
+/**
+ * xvip_profile_add - Define or redefine a profile
+ * @xdev: Composite video device
+ * @name: name of the profile
+ * @buf: settings of the profile, one per line
+ * @len: length of @buf
+ *
+ * Must be called with the device lock held.
+ *
+ * Return: 0 on success or a negative error code
+ */
+static int xvip_profile_add(struct xvip_composite_device *xdev,
+			    const char *name, const char *buf, size_t len)
+{
+	struct xvip_profile *profile;
+	struct xvip_profile *old;
+	int ret;
+
+	profile = kzalloc(sizeof(*profile), GFP_KERNEL);
+	if (!profile)
+		return -ENOMEM;
+
+	profile->name = kstrdup(name, GFP_KERNEL);
+	if (!profile->name) {
+		ret = -ENOMEM;
+		goto error;
+	}
+
+	profile->cfg = xvip_config_parse(xdev, buf, len);
+	if (IS_ERR(profile->cfg)) {
+		ret = PTR_ERR(profile->cfg);
+		profile->cfg = NULL;
+		goto error;
+	}
+
+	ret = xvip_config_validate(xdev, profile->cfg);
+	if (ret < 0)
+		goto error;
+
+	old = xvip_profile_find(xdev, name);
+	if (old) {
+		if (xdev->active_profile == old)
+			xdev->active_profile = NULL;
+		list_del(&old->list);
+		xvip_profile_free(old);
+	}
+
+	list_add_tail(&profile->list, &xdev->profiles);
+	dev_dbg(xdev->dev, "profile %s: %u settings\n", name,
+		profile->cfg->count);
+
+	return 0;
+
+error:
+	dev_err(xdev->dev, "invalid profile %s (%d)\n", name, ret);
+	xvip_profile_free(profile);
+	return ret;
+}
+
+/**
+ * xvip_profile_switch - Switch the pipeline to a profile
+ * @xdev: Composite video device
+ * @name: name of the profile
+ *
+ * Must be called with the device lock held.
+ *
+ * Return: 0 on success or a negative error code
+ */
+static int xvip_profile_switch(struct xvip_composite_device *xdev,
+			       const char *name)
+{
+	struct xvip_profile *profile;
+	int ret;
+
+	profile = xvip_profile_find(xdev, name);
+	if (!profile)
+		return -ENOENT;
+
+	ret = xvip_reconfigure(xdev, profile->cfg);
+	xdev->active_profile = ret < 0 ? NULL : profile;
+
+	return ret;
+}
+
+/*
+ * Find the partition owning the entity named @name, or return NULL if no
+ * partition has it. Takes the lock of every partition in turn.
+ */
+static struct xvip_composite_device *
+xvip_partition_of(struct xvip_composite_device *xdev, const char *name)
+{
+	struct xvip_composite_device *part;
+	bool found;
+
+	list_for_each_entry(part, &xdev->partitions, partition) {
+		mutex_lock(&part->lock);
+		found = xvip_graph_find_entity_by_name(part, name);
+		mutex_unlock(&part->lock);
+		if (found)
+			return part;
+	}
+
+	return NULL;
+}
+
+/**
+ * xvip_config_partition - Find the partition a configuration applies to
+ * @xdev: primary composite device
+ * @buf: configuration lines, each starting with an entity name
+ * @count: length of @buf
+ *
+ * Control batches and reconfigurations are applied by a single partition in a
+ * single frame, so all the entities they name must belong to the same
+ * partition. The partition locks must not be held.
+ *
+ * Return: the partition owning the entities, @xdev if @buf names none, or an
+ * ERR_PTR: -ENODEV if an entity is unknown, -EXDEV if the entities belong to
+ * different partitions
+ */
+static struct xvip_composite_device *
+xvip_config_partition(struct xvip_composite_device *xdev, const char *buf,
+		      size_t count)
+{
+	struct xvip_composite_device *owner = NULL;
+	struct xvip_composite_device *part;
+	char *lines, *pos, *line, *name;
+
+	lines = kstrndup(buf, count, GFP_KERNEL);
+	if (!lines)
+		return ERR_PTR(-ENOMEM);
+
+	pos = lines;
+	while ((line = strsep(&pos, "\n")) != NULL) {
+		name = xvip_next_token(&line);
+		if (!name)
+			continue;
+
+		part = xvip_partition_of(xdev, name);
+		if (!part) {
+			dev_dbg(xdev->dev, "unknown entity '%s'\n", name);
+			owner = ERR_PTR(-ENODEV);
+			break;
+		}
+
+		if (owner && owner != part) {
+			dev_dbg(xdev->dev, "'%s' is in another partition\n",
+				name);
+			owner = ERR_PTR(-EXDEV);
+			break;
+		}
+
+		owner = part;
+	}
+
+	kfree(lines);
+
+	return owner ? owner : xdev;
+}
+
+/**
+ * xvip_config_filter - Extract the lines of a configuration for a partition
+ * @xdev: primary composite device, or NULL
+ * @part: partition
+ * @buf: configuration lines, each starting with an entity name
+ * @count: length of @buf
+ *
+ * With @xdev set, the lines naming an entity of no partition are kept for
+ * @xdev, and the partition locks must not be held. With @xdev NULL, they are
+ * dropped and the caller must hold the lock of @part.
+ *
+ * Return: the lines for @part, possibly none, to be freed with kfree(), or
+ * NULL on allocation failure
+ */
+static char *xvip_config_filter(struct xvip_composite_device *xdev,
+				struct xvip_composite_device *part,
+				const char *buf, size_t count)
+{
+	struct xvip_composite_device *owner;
+	char *lines, *out, *pos, *line, *name;
+	size_t len = 0;
+	size_t n;
+	bool keep;
+
+	lines = kstrndup(buf, count, GFP_KERNEL);
+	out = kzalloc(count + 2, GFP_KERNEL);
+	if (!lines || !out) {
+		kfree(out);
+		kfree(lines);
+		return NULL;
+	}
+
+	pos = lines;
+	while ((line = strsep(&pos, "\n")) != NULL) {
+		/* Copy the line first, the tokenizer modifies it. */
+		n = strlen(line);
+		memcpy(out + len, line, n);
+		out[len + n] = '\n';
+
+		name = xvip_next_token(&line);
+		if (!name)
+			continue;
+
+		if (xdev) {
+			owner = xvip_partition_of(xdev, name);
+			keep = (owner ? owner : xdev) == part;
+		} else
+			keep = xvip_graph_find_entity_by_name(part, name);
+		if (keep)
+			len += n + 1;
+	}
+
+	out[len] = '\0';
+	kfree(lines);
+
+	return out;
+}
+
+static void xvip_profiles_init(struct xvip_composite_device *xdev)
+{
+	struct device_node *node;
+	struct device_node *child;
+	struct property *prop;
+	const char *setting;
+	char *lines;
+	char *name;
+	char *buf;
+	size_t len;
+	bool partitioned;
+
+	node = of_get_child_by_name(xdev->dev->of_node, "profiles");
+	if (!node)
+		return;
+
+	/*
+	 * The profiles can span partitions, each partition keeps the settings
+	 * of its own entities. Only the primary device without partitions is
+	 * alone on its list.
+	 */
+	partitioned = !list_is_singular(&xdev->partitions);
+
+	mutex_lock(&xdev->lock);
+
+	for_each_child_of_node(node, child) {
+		len = 0;
+		of_property_for_each_string(child, "settings", prop, setting)
+			len += strlen(setting) + 1;
+
+		buf = kzalloc(len + 1, GFP_KERNEL);
+		name = kasprintf(GFP_KERNEL, "%pOFn", child);
+		if (buf && name) {
+			of_property_for_each_string(child, "settings", prop,
+						    setting) {
+				strcat(buf, setting);
+				strcat(buf, "\n");
+			}
+
+			if (!partitioned) {
+				xvip_profile_add(xdev, name, buf, len);
+			} else {
+				lines = xvip_config_filter(NULL, xdev, buf, len);
+				if (lines && *lines)
+					xvip_profile_add(xdev, name, lines,
+							 strlen(lines));
+				kfree(lines);
+			}
+		}
+
+		kfree(name);
+		kfree(buf);
+	}
+
+	mutex_unlock(&xdev->lock);
+
+	of_node_put(node);
+}
+
+static void xvip_profiles_cleanup(struct xvip_composite_device *xdev)
+{
+	struct xvip_profile *profile, *next;
+
+	mutex_lock(&xdev->lock);
+
+	list_for_each_entry_safe(profile, next, &xdev->profiles, list) {
+		list_del(&profile->list);
+		xvip_profile_free(profile);
+	}
+	xdev->active_profile = NULL;
+
+	mutex_unlock(&xdev->lock);
+}
+
+/*
+ * When the "topic,subdev-nodes" property lists the entities that userspace
+ * needs to access, only create subdev device nodes for those.
+ */
+static void xvip_graph_select_subdev_nodes(struct xvip_composite_device *xdev)
+{
+	struct device_node *node = xdev->dev->of_node;
+	struct xvip_graph_entity *entity;
+	struct device_node *np;
+	unsigned int i, j;
+	bool keep;
+
+	if (!of_find_property(node, "topic,subdev-nodes", NULL))
+		return;
+
+	for (j = 0; j < xdev->num_subdevs; j++) {
+		entity = &xdev->entities[j];
+
+		keep = false;
+		for (i = 0; !keep; i++) {
+			np = of_parse_phandle(node, "topic,subdev-nodes", i);
+			if (!np)
+				break;
+			keep = of_fwnode_handle(np) == entity->fwnode;
+			of_node_put(np);
+		}
+
+		if (!keep)
+			entity->subdev->flags &= ~V4L2_SUBDEV_FL_HAS_DEVNODE;
+	}
+}
+
+/*
+ * Allocate the runtime state of the entities, one slot per async subdev. The
+ * slots are assigned in bind order and their index is used as the entity id
+ * by the start order and adjacency arrays.
+ */
+static int xvip_graph_alloc_entities(struct xvip_composite_device *xdev)
+{
+	struct v4l2_async_subdev *asd;
+	unsigned int count = 0;
+
+	list_for_each_entry(asd, &xdev->notifier.asd_list, asd_list)
+		count++;
+
+	xdev->entities = kcalloc(count, sizeof(*xdev->entities), GFP_KERNEL);
+	if (!xdev->entities)
+		return -ENOMEM;
+
+	xdev->entity_frame_syncs = __alloc_percpu(count * sizeof(unsigned long),
+						  sizeof(unsigned long));
+	if (!xdev->entity_frame_syncs) {
+		kfree(xdev->entities);
+		xdev->entities = NULL;
+		return -ENOMEM;
+	}
+
+	xdev->entities_size = count;
+
+	return 0;
+}
+
+static void xvip_graph_free_entities(struct xvip_composite_device *xdev)
+{
+	free_percpu(xdev->entity_frame_syncs);
+	xdev->entity_frame_syncs = NULL;
+	kfree(xdev->entities);
+	xdev->entities = NULL;
+	xdev->entities_size = 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Memory Bandwidth
+ *
+ * When the composite node has an "interconnects" path to memory, the memory
+ * bandwidth of the started pipelines is computed from their formats and frame
+ * intervals and voted on the path, so that the memory clock can scale with
+ * the camera traffic. The vote is dropped when the stream stops.
+ */
+
+/*
+ * Bits per pixel in memory of a media bus code, padded the way the DMA
+ * engines store them. Formats not listed are assumed to take 16 bits.
+ */
+static unsigned int xvip_mbus_bpp(u32 code)
+{
+	switch (code) {
+	case MEDIA_BUS_FMT_Y8_1X8:
+	case MEDIA_BUS_FMT_SBGGR8_1X8:
+	case MEDIA_BUS_FMT_SGBRG8_1X8:
+	case MEDIA_BUS_FMT_SGRBG8_1X8:
+	case MEDIA_BUS_FMT_SRGGB8_1X8:
+		return 8;
+	case MEDIA_BUS_FMT_RGB888_1X24:
+	case MEDIA_BUS_FMT_RBG888_1X24:
+	case MEDIA_BUS_FMT_VUY8_1X24:
+		return 24;
+	case MEDIA_BUS_FMT_RGB888_1X32_PADHI:
+	case MEDIA_BUS_FMT_ARGB8888_1X32:
+		return 32;
+	default:
+		return 16;
+	}
+}
+
+/*
+ * Bytes per frame written to memory by an entity that doesn't feed any other
+ * entity, that is one feeding the DMA engines: the formats on its source pads.
+ */
+static u64 xvip_output_bytes(struct xvip_graph_entity *entity)
+{
+	struct v4l2_subdev_format fmt = {
+		.which = V4L2_SUBDEV_FORMAT_ACTIVE,
+	};
+	unsigned int pad;
+	u64 bytes = 0;
+	int ret;
+
+	for (pad = 0; pad < entity->entity->num_pads; pad++) {
+		if (!(entity->entity->pads[pad].flags & MEDIA_PAD_FL_SOURCE))
+			continue;
+
+		fmt.pad = pad;
+		ret = v4l2_subdev_call(entity->subdev, pad, get_fmt, NULL,
+				       &fmt);
+		if (ret < 0)
+			continue;
+
+		bytes += (u64)fmt.format.width * fmt.format.height *
+			 xvip_mbus_bpp(fmt.format.code) / 8;
+	}
+
+	return bytes;
+}
+
+/*
+ * Record the frame interval of a source on the DMA outputs of its downstream
+ * chain, keeping the shortest one when an output is fed by several sources.
+ */
+static void xvip_source_outputs(struct xvip_composite_device *xdev,
+				struct xvip_graph_entity *source,
+				struct v4l2_fract *intervals)
+{
+	struct v4l2_subdev_frame_interval ival = { .pad = 0 };
+	struct v4l2_fract *best;
+	unsigned int i, id;
+	int ret;
+
+	ret = v4l2_subdev_call(source->subdev, video, g_frame_interval, &ival);
+	if (ret < 0 || !ival.interval.numerator || !ival.interval.denominator)
+		return;
+
+	for (i = 0; i < source->num_downstream; i++) {
+		id = source->downstream[i];
+		if (xdev->successor_offsets[id] !=
+		    xdev->successor_offsets[id + 1])
+			continue;
+
+		best = &intervals[id];
+		if (!best->numerator ||
+		    (u64)ival.interval.numerator * best->denominator <
+		    (u64)best->numerator * ival.interval.denominator)
+			*best = ival.interval;
+	}
+}
+
+/*
+ * Vote the memory bandwidth of all started components on the interconnect
+ * path: the output of every DMA engine fed by a source out of standby, counted
+ * once at the rate of the fastest source feeding it. Must be called with the
+ * device lock held.
+ */
+static void xvip_icc_update(struct xvip_composite_device *xdev)
+{
+	struct xvip_component *component;
+	struct xvip_graph_entity *entity;
+	struct v4l2_fract *intervals;
+	u64 bandwidth = 0;
+	unsigned int i, j;
+	u32 kbps;
+	int ret;
+
+	if (!xdev->icc_path)
+		return;
+
+	intervals = kcalloc(xdev->num_subdevs, sizeof(*intervals), GFP_KERNEL);
+	if (!intervals)
+		return;
+
+	for (i = 0; i < xdev->num_components; i++) {
+		component = &xdev->components[i];
+		if (component->source == XVIP_NO_ENTITY ||
+		    xdev->entities[component->source].entity->pipe != &xdev->pipe)
+			continue;
+
+		for (j = 0; j < component->num_entities; j++) {
+			entity = &xdev->entities[
+				xdev->start_order[component->first + j]];
+			if (entity->downstream && !entity->standby)
+				xvip_source_outputs(xdev, entity, intervals);
+		}
+	}
+
+	for (i = 0; i < xdev->num_subdevs; i++) {
+		if (!intervals[i].numerator)
+			continue;
+
+		bandwidth += div_u64(xvip_output_bytes(&xdev->entities[i]) *
+				     intervals[i].denominator,
+				     intervals[i].numerator);
+	}
+
+	kfree(intervals);
+
+	kbps = Bps_to_icc(min_t(u64, bandwidth, (u64)U32_MAX * 1000));
+	if (kbps == xdev->icc_bw)
+		return;
+
+	ret = icc_set_bw(xdev->icc_path, kbps, kbps);
+	if (ret < 0) {
+		dev_err(xdev->dev, "failed to vote %u kBps (%d)\n", kbps, ret);
+		return;
+	}
+
+	dev_dbg(xdev->dev, "memory bandwidth vote %u kBps\n", kbps);
+	xdev->icc_bw = kbps;
+}
+
+static int xvip_icc_init(struct xvip_composite_device *xdev)
+{
+	xdev->icc_path = of_icc_get(xdev->dev, NULL);
+	if (IS_ERR(xdev->icc_path)) {
+		int ret = PTR_ERR(xdev->icc_path);
+
+		xdev->icc_path = NULL;
+		if (ret != -EPROBE_DEFER)
+			dev_err(xdev->dev, "failed to get interconnect path\n");
+		return ret;
+	}
+
+	return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Thermal Throttling
+ *
+ * Sensors listed in the "thermal" child node are throttled on temperature.
+ * Each child node references the sensor through its "sensor" phandle and reads
+ * the temperature from the "thermal-zone" named zone or from the sensor's
+ * "temperature-control" control. Crossing each of the ascending "trips"
+ * switches the sensor to the next of the "frame-intervals" (numerator,
+ * denominator pairs) and the trips beyond them put the sensor in standby. A
+ * level is left when the temperature drops "hysteresis" below its trip point.
+ *
+ *	thermal {
+ *		polling-delay-ms = <500>;
+ *		sensor0 {
+ *			sensor = <&imx274_0>;
+ *			thermal-zone = "cam0-thermal";
+ *			trips = <70000 80000 90000>;
+ *			frame-intervals = <1 30 1 15>;
+ *			hysteresis = <3000>;
+ *		};
+ *	};
+ */
+
+#define XVIP_THERMAL_DEFAULT_PERIOD_MS		1000
+#define XVIP_THERMAL_DEFAULT_HYSTERESIS		2000
+
+static void xvip_thermal_uevent(struct xvip_composite_device *xdev,
+				struct xvip_thermal *th)
+{
+	char *envp[4] = { NULL };
+	unsigned int i;
+
+	envp[0] = kasprintf(GFP_KERNEL, "MEDIACTL_THERMAL=%s",
+			    th->entity->entity->name);
+	envp[1] = kasprintf(GFP_KERNEL, "MEDIACTL_THERMAL_LEVEL=%u",
+			    th->level);
+	envp[2] = kasprintf(GFP_KERNEL, "MEDIACTL_TEMPERATURE=%d", th->temp);
+
+	if (envp[0] && envp[1] && envp[2])
+		kobject_uevent_env(&xdev->dev->kobj, KOBJ_CHANGE, envp);
+
+	for (i = 0; i < ARRAY_SIZE(envp) - 1; i++)
+		kfree(envp[i]);
+}
+
+/* Must be called with the device lock held. */
+static void xvip_thermal_apply(struct xvip_composite_device *xdev,
+			       struct xvip_thermal *th, unsigned int level)
+{
+	struct xvip_graph_entity *entity = th->entity;
+	struct v4l2_subdev_frame_interval ival = { .pad = 0 };
+	bool standby = level > th->num_intervals;
+	int ret;
+
+	if (!th->level) {
+		ret = v4l2_subdev_call(entity->subdev, video, g_frame_interval,
+				       &ival);
+		th->nominal = ret < 0 ? (struct v4l2_fract){ 0, 0 }
+				      : ival.interval;
+	}
+
+	/* The sensor only resumes if it isn't in standby for the user. */
+	if (standby) {
+		ret = xvip_entity_standby(xdev, entity, XVIP_STANDBY_THERMAL,
+					  true);
+	} else {
+		ival.interval = level ? th->intervals[level - 1] : th->nominal;
+		ret = 0;
+		if (ival.interval.numerator)
+			ret = v4l2_subdev_call(entity->subdev, video,
+					       s_frame_interval, &ival);
+		if (ret >= 0)
+			ret = xvip_entity_standby(xdev, entity,
+						  XVIP_STANDBY_THERMAL, false);
+	}
+
+	if (ret < 0 && ret != -ENOIOCTLCMD) {
+		dev_err(xdev->dev, "%s: failed to apply thermal level %u\n",
+			entity->entity->name, level);
+		return;
+	}
+
+	xvip_entity_update_interval(entity);
+	xvip_icc_update(xdev);
+	th->level = level;
+	th->events++;
+
+	dev_info(xdev->dev, "%s: thermal level %u at %d mC%s\n",
+		 entity->entity->name, level, th->temp,
+		 standby ? ", standby" : "");
+	xvip_thermal_uevent(xdev, th);
+}
+
+/* Must be called with the device lock held. */
+static void xvip_thermal_update(struct xvip_composite_device *xdev,
+				struct xvip_thermal *th)
+{
+	unsigned int level;
+	int temp;
+	int ret;
+
+	if (th->tz) {
+		ret = thermal_zone_get_temp(th->tz, &temp);
+		if (ret < 0)
+			return;
+	} else {
+		temp = v4l2_ctrl_g_ctrl(th->ctrl) * th->scale;
+	}
+
+	th->temp = temp;
+
+	/*
+	 * Throttling only applies to a running sensor. Restore the nominal
+	 * frame interval when it stops, the next start must not begin at the
+	 * throttled rate and the next throttling must not take it as nominal.
+	 */
+	if (!th->entity->prepared) {
+		if (th->level) {
+			struct v4l2_subdev_frame_interval ival = {
+				.interval = th->nominal,
+			};
+
+			if (th->nominal.numerator &&
+			    v4l2_subdev_call(th->entity->subdev, video,
+					     s_frame_interval, &ival) < 0)
+				dev_warn(xdev->dev,
+					 "%s: failed to restore frame interval\n",
+					 th->entity->entity->name);
+			th->level = 0;
+		}
+		return;
+	}
+
+	level = th->level;
+	while (level < th->num_trips && temp >= (int)th->trips[level])
+		level++;
+	while (level > 0 &&
+	       temp < (int)th->trips[level - 1] - (int)th->hysteresis)
+		level--;
+
+	if (level != th->level)
+		xvip_thermal_apply(xdev, th, level);
+}
+
+static void xvip_thermal_work(struct kthread_work *work)
+{
+	struct xvip_composite_device *xdev =
+		container_of(work, struct xvip_composite_device,
+			     thermal_work.work);
+	struct xvip_thermal *th;
+
+	mutex_lock(&xdev->lock);
+	list_for_each_entry(th, &xdev->thermals, list)
+		xvip_thermal_update(xdev, th);
+	mutex_unlock(&xdev->lock);
+
+	kthread_queue_delayed_work(xdev->control_worker, &xdev->thermal_work,
+				   msecs_to_jiffies(xdev->thermal_period_ms));
+}
+
+static void xvip_thermal_free(struct xvip_thermal *th)
+{
+	kfree(th->trips);
+	kfree(th->intervals);
+	kfree(th);
+}
+
+static struct xvip_thermal *
+xvip_thermal_parse_one(struct xvip_composite_device *xdev,
+		       struct device_node *node)
+{
+	struct xvip_graph_entity *entity;
+	struct device_node *sensor;
+	struct xvip_thermal *th;
+	const char *zone;
+	u32 *values;
+	int count;
+	int ret;
+	u32 cid;
+	int i;
+
+	sensor = of_parse_phandle(node, "sensor", 0);
+	entity = xvip_graph_find_entity(xdev, of_fwnode_handle(sensor));
+	of_node_put(sensor);
+	if (!entity)
+		return ERR_PTR(-ENOENT);
+
+	th = kzalloc(sizeof(*th), GFP_KERNEL);
+	if (!th)
+		return ERR_PTR(-ENOMEM);
+
+	th->entity = entity;
+	th->scale = 1000;
+	th->hysteresis = XVIP_THERMAL_DEFAULT_HYSTERESIS;
+	of_property_read_u32(node, "temperature-scale", &th->scale);
+	of_property_read_u32(node, "hysteresis", &th->hysteresis);
+
+	ret = -EINVAL;
+	if (!of_property_read_string(node, "thermal-zone", &zone)) {
+		th->tz = thermal_zone_get_zone_by_name(zone);
+		if (IS_ERR(th->tz)) {
+			ret = PTR_ERR(th->tz);
+			goto error;
+		}
+	} else if (!of_property_read_u32(node, "temperature-control", &cid)) {
+		th->ctrl = v4l2_ctrl_find(entity->subdev->ctrl_handler, cid);
+		if (!th->ctrl)
+			goto error;
+	} else {
+		goto error;
+	}
+
+	count = of_property_count_u32_elems(node, "trips");
+	if (count <= 0)
+		goto error;
+
+	ret = -ENOMEM;
+	th->trips = kcalloc(count, sizeof(*th->trips), GFP_KERNEL);
+	if (!th->trips)
+		goto error;
+
+	th->num_trips = count;
+	of_property_read_u32_array(node, "trips", th->trips, count);
+
+	count = of_property_count_u32_elems(node, "frame-intervals");
+	if (count > 0) {
+		ret = -EINVAL;
+		if (count % 2)
+			goto error;
+
+		ret = -ENOMEM;
+		values = kcalloc(count, sizeof(*values), GFP_KERNEL);
+		th->intervals = kcalloc(count / 2, sizeof(*th->intervals),
+					GFP_KERNEL);
+		if (!values || !th->intervals) {
+			kfree(values);
+			goto error;
+		}
+
+		of_property_read_u32_array(node, "frame-intervals", values,
+					   count);
+		for (i = 0; i < count / 2; i++) {
+			th->intervals[i].numerator = values[2 * i];
+			th->intervals[i].denominator = values[2 * i + 1];
+		}
+		th->num_intervals = count / 2;
+		kfree(values);
+	}
+
+	return th;
+
+error:
+	xvip_thermal_free(th);
+	return ERR_PTR(ret);
+}
+
+static void xvip_thermal_init(struct xvip_composite_device *xdev)
+{
+	struct device_node *node;
+	struct device_node *child;
+	struct xvip_thermal *th;
+
+	node = of_get_child_by_name(xdev->dev->of_node, "thermal");
+	if (!node)
+		return;
+
+	xdev->thermal_period_ms = XVIP_THERMAL_DEFAULT_PERIOD_MS;
+	of_property_read_u32(node, "polling-delay-ms",
+			     &xdev->thermal_period_ms);
+
+	for_each_available_child_of_node(node, child) {
+		th = xvip_thermal_parse_one(xdev, child);
+		if (IS_ERR(th)) {
+			/* Sensors of other partitions are skipped silently. */
+			if (PTR_ERR(th) != -ENOENT)
+				dev_err(xdev->dev,
+					"invalid thermal binding %pOFn (%ld)\n",
+					child, PTR_ERR(th));
+			continue;
+		}
+
+		list_add_tail(&th->list, &xdev->thermals);
+	}
+
+	of_node_put(node);
+
+	if (!list_empty(&xdev->thermals))
+		kthread_queue_delayed_work(xdev->control_worker,
+					   &xdev->thermal_work, 0);
+}
+
+static void xvip_thermal_cleanup(struct xvip_composite_device *xdev)
+{
+	struct xvip_thermal *th;
+	struct xvip_thermal *next;
+
+	kthread_cancel_delayed_work_sync(&xdev->thermal_work);
+
+	list_for_each_entry_safe(th, next, &xdev->thermals, list) {
+		list_del(&th->list);
+		xvip_thermal_free(th);
+	}
+}
+
+/* -----------------------------------------------------------------------------
+ * Precompiled Graph Description
+ *
+ * Units with fixed hardware can ship the result of the graph parsing as a
+ * firmware file, named by the "topic,graph-firmware" property. The file starts
+ * with a header followed by the entities, identified by the full path of their
+ * DT node, and by the links between them:
+ *
+ *	struct xvip_graph_fw_header
+ *	struct xvip_graph_fw_entity	[num_entities]
+ *	struct xvip_graph_fw_link	[num_links]
+ *
+ * @crc covers everything following the header and @dt_crc the path, compatible
+ * string and endpoints of every entity node, so that a file built for another
+ * device tree, including one that only rewires the ports, is rejected and the
+ * driver falls back to parsing the graph.
+ *
+ * Both are the standard CRC-32 (IEEE 802.3, reflected, initial value and final
+ * XOR 0xffffffff), as computed by zlib's crc32(). @dt_crc is computed over the
+ * concatenation, in entity order, of the NUL-terminated full path of each node
+ * followed by its NUL-terminated first compatible string (empty if none) and,
+ * for each of its endpoints in DT order:
+ *
+ *	u32	port number (reg of the port node)
+ *	u32	endpoint number (reg of the endpoint node)
+ *	char	NUL-terminated full path of the remote port parent, truncated to
+ *		XVIP_GRAPH_FW_PATH_MAX - 1 characters (empty if unconnected)
+ *	u32	remote port number
+ *	u32	remote endpoint number
+ *
+ * All fields are little endian.
+ */
+
+#define XVIP_GRAPH_FW_MAGIC	0x46475658	/* "XVGF" */
+#define XVIP_GRAPH_FW_VERSION	2
+#define XVIP_GRAPH_FW_PATH_MAX	128
+
+struct xvip_graph_fw_header {
+	__le32 magic;
+	__le32 version;
+	__le32 crc;
+	__le32 dt_crc;
+	__le32 num_entities;
+	__le32 num_links;
+} __packed;
+
+struct xvip_graph_fw_entity {
+	char path[XVIP_GRAPH_FW_PATH_MAX];
+} __packed;
+
+struct xvip_graph_fw_link {
+	__le16 source;
+	__le16 source_pad;
+	__le16 sink;
+	__le16 sink_pad;
+	__le32 flags;
+} __packed;
+
+static u32 xvip_graph_fw_crc_u32(u32 crc, u32 value)
+{
+	__le32 le = cpu_to_le32(value);
+
+	return crc32_le(crc, (const u8 *)&le, sizeof(le));
+}
+
+static u32 xvip_graph_fw_crc_path(u32 crc, struct device_node *node)
+{
+	char path[XVIP_GRAPH_FW_PATH_MAX] = "";
+
+	if (node)
+		snprintf(path, sizeof(path), "%pOF", node);
+
+	return crc32_le(crc, path, strlen(path) + 1);
+}
+
+static u32 xvip_graph_fw_dt_crc(u32 crc, struct device_node *node)
+{
+	struct of_endpoint local = { };
+	struct of_endpoint remote = { };
+	struct device_node *remote_ep;
+	struct device_node *parent;
+	const char *compatible = "";
+	struct device_node *ep;
+
+	of_property_read_string(node, "compatible", &compatible);
+
+	crc = xvip_graph_fw_crc_path(crc, node);
+	crc = crc32_le(crc, compatible, strlen(compatible) + 1);
+
+	for_each_endpoint_of_node(node, ep) {
+		of_graph_parse_endpoint(ep, &local);
+
+		remote_ep = of_graph_get_remote_endpoint(ep);
+		parent = of_graph_get_remote_port_parent(ep);
+		memset(&remote, 0, sizeof(remote));
+		if (remote_ep)
+			of_graph_parse_endpoint(remote_ep, &remote);
+
+		crc = xvip_graph_fw_crc_u32(crc, local.port);
+		crc = xvip_graph_fw_crc_u32(crc, local.id);
+		crc = xvip_graph_fw_crc_path(crc, parent);
+		crc = xvip_graph_fw_crc_u32(crc, remote.port);
+		crc = xvip_graph_fw_crc_u32(crc, remote.id);
+
+		of_node_put(parent);
+		of_node_put(remote_ep);
+	}
+
+	return crc;
+}
+
+static int xvip_graph_parse_fw(struct xvip_composite_device *xdev,
+			       const struct firmware *fw,
+			       struct fwnode_handle **fwnodes)
+{
+	const struct xvip_graph_fw_header *hdr = (const void *)fw->data;
+	const struct xvip_graph_fw_entity *entities;
+	const struct xvip_graph_fw_link *links;
+	struct xvip_graph_link *link;
+	struct device_node *node;
+	unsigned int num_entities;
+	unsigned int num_links;
+	struct v4l2_async_subdev *asd;
+	unsigned int i;
+	u32 crc = ~0;
+
+	num_entities = le32_to_cpu(hdr->num_entities);
+	num_links = le32_to_cpu(hdr->num_links);
+	entities = (const void *)(hdr + 1);
+	links = (const void *)(entities + num_entities);
+
+	for (i = 0; i < num_entities; i++) {
+		if (strnlen(entities[i].path, XVIP_GRAPH_FW_PATH_MAX) ==
+		    XVIP_GRAPH_FW_PATH_MAX)
+			return -EINVAL;
+
+		node = of_find_node_by_path(entities[i].path);
+		if (!node || !of_device_is_available(node)) {
+			dev_warn(xdev->dev, "graph firmware: no node %s\n",
+				 entities[i].path);
+			of_node_put(node);
+			return -ENODEV;
+		}
+
+		crc = xvip_graph_fw_dt_crc(crc, node);
+		fwnodes[i] = of_fwnode_handle(node);
+	}
+
+	if (~crc != le32_to_cpu(hdr->dt_crc)) {
+		dev_warn(xdev->dev, "graph firmware doesn't match the DT\n");
+		return -ESTALE;
+	}
+
+	xdev->fw_links = kcalloc(num_links, sizeof(*xdev->fw_links),
+				 GFP_KERNEL);
+	if (!xdev->fw_links)
+		return -ENOMEM;
+
+	for (i = 0; i < num_links; i++) {
+		if (le16_to_cpu(links[i].source) >= num_entities ||
+		    le16_to_cpu(links[i].sink) >= num_entities)
+			return -EINVAL;
+
+		link = &xdev->fw_links[i];
+		link->source = fwnodes[le16_to_cpu(links[i].source)];
+		link->source_pad = le16_to_cpu(links[i].source_pad);
+		link->sink = fwnodes[le16_to_cpu(links[i].sink)];
+		link->sink_pad = le16_to_cpu(links[i].sink_pad);
+		link->flags = le32_to_cpu(links[i].flags);
+	}
+
+	xdev->num_fw_links = num_links;
+
+	for (i = 0; i < num_entities; i++) {
+		asd = v4l2_async_notifier_add_fwnode_subdev(&xdev->notifier,
+				fwnodes[i], sizeof(struct xvip_graph_asd));
+		if (IS_ERR(asd))
+			return PTR_ERR(asd);
+	}
+
+	return 0;
+}
+
+/**
+ * xvip_graph_load_fw - Load the precompiled graph description
+ * @xdev: Composite video device
+ *
+ * Register an async subdev for every entity of the description and store its
+ * links, to be created when all subdevs are bound.
+ *
+ * Return: 0 on success or a negative error code if there is no usable graph
+ * firmware, in which case the graph must be parsed from the device tree
+ */
+static int xvip_graph_load_fw(struct xvip_composite_device *xdev)
+{
+	const struct xvip_graph_fw_header *hdr;
+	struct fwnode_handle **fwnodes = NULL;
+	const struct firmware *fw;
+	unsigned int num_entities = 0;
+	const char *name;
+	size_t size;
+	unsigned int i;
+	int ret;
+
+	if (of_property_read_string(xdev->dev->of_node, "topic,graph-firmware",
+				    &name))
+		return -ENOENT;
+
+	ret = request_firmware(&fw, name, xdev->dev);
+	if (ret < 0) {
+		dev_warn(xdev->dev, "failed to load graph firmware %s\n", name);
+		return ret;
+	}
+
+	ret = -EINVAL;
+	hdr = (const void *)fw->data;
+	if (fw->size < sizeof(*hdr) ||
+	    le32_to_cpu(hdr->magic) != XVIP_GRAPH_FW_MAGIC ||
+	    le32_to_cpu(hdr->version) != XVIP_GRAPH_FW_VERSION)
+		goto done;
+
+	num_entities = le32_to_cpu(hdr->num_entities);
+	size = sizeof(*hdr)
+	     + (size_t)num_entities * sizeof(struct xvip_graph_fw_entity)
+	     + (size_t)le32_to_cpu(hdr->num_links)
+	       * sizeof(struct xvip_graph_fw_link);
+	if (!num_entities || num_entities > U16_MAX || fw->size != size ||
+	    ~crc32_le(~0, fw->data + sizeof(*hdr), size - sizeof(*hdr)) !=
+	    le32_to_cpu(hdr->crc))
+		goto done;
+
+	ret = -ENOMEM;
+	fwnodes = kcalloc(num_entities, sizeof(*fwnodes), GFP_KERNEL);
+	if (!fwnodes)
+		goto done;
+
+	ret = xvip_graph_parse_fw(xdev, fw, fwnodes);
+
+done:
+	/* The async subdevs hold their own reference to the nodes. */
+	for (i = 0; fwnodes && i < num_entities; i++)
+		fwnode_handle_put(fwnodes[i]);
+	kfree(fwnodes);
+	release_firmware(fw);
+
+	if (ret < 0) {
+		dev_warn(xdev->dev, "ignoring graph firmware %s (%d)\n",
+			 name, ret);
+		v4l2_async_notifier_cleanup(&xdev->notifier);
+		kfree(xdev->fw_links);
+		xdev->fw_links = NULL;
+		xdev->num_fw_links = 0;
+		return ret;
+	}
+
+	dev_dbg(xdev->dev, "graph loaded from %s, %u entities, %u links\n",
+		name, num_entities, xdev->num_fw_links);
+
+	return 0;
+}
+
+/* Create the links of the precompiled graph description. */
+static int xvip_graph_build_fw(struct xvip_composite_device *xdev)
+{
+	struct xvip_graph_entity *source;
+	struct xvip_graph_entity *sink;
+	struct xvip_graph_link *link;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < xdev->num_subdevs; i++)
+		xvip_graph_name_entity(xdev->entities[i].entity);
+
+	for (i = 0; i < xdev->num_fw_links; i++) {
+		link = &xdev->fw_links[i];
+		source = xvip_graph_find_entity(xdev, link->source);
+		sink = xvip_graph_find_entity(xdev, link->sink);
+		if (!source || !sink)
+			return -ENODEV;
+
+		if (link->source_pad >= source->entity->num_pads ||
+		    link->sink_pad >= sink->entity->num_pads) {
+			dev_err(xdev->dev, "invalid pads for %s -> %s link\n",
+				source->entity->name, sink->entity->name);
+			return -EINVAL;
+		}
+
+		ret = media_create_pad_link(source->entity, link->source_pad,
+					    sink->entity, link->sink_pad,
+					    link->flags);
+		if (ret < 0) {
+			dev_err(xdev->dev,
+				"failed to create %s:%u -> %s:%u link\n",
+				source->entity->name, link->source_pad,
+				sink->entity->name, link->sink_pad);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Generic Netlink Events
+ *
+ * The "topic-mediactl" generic netlink family accepts start, stop and standby
+ * commands for a device named by XVIP_NL_ATTR_DEVICE and a query dump of all
+ * devices or of the named one. It multicasts state changes, errors and
+ * periodic statistics of every media device (partition) to its "events"
+ * group.
+ */
+
+enum xvip_nl_cmd {
+	XVIP_NL_CMD_UNSPEC,
+	XVIP_NL_CMD_START,
+	XVIP_NL_CMD_STOP,
+	XVIP_NL_CMD_STANDBY,
+	XVIP_NL_CMD_QUERY,
+	XVIP_NL_CMD_STATE,	/* event */
+	XVIP_NL_CMD_ERROR,	/* event */
+	XVIP_NL_CMD_STATS,	/* event */
+	__XVIP_NL_CMD_MAX,
+};
+
+enum xvip_nl_attr {
+	XVIP_NL_ATTR_UNSPEC,
+	XVIP_NL_ATTR_DEVICE,		/* string */
+	XVIP_NL_ATTR_PARTITION,		/* u32 */
+	XVIP_NL_ATTR_STATE,		/* u8, enum xvip_nl_state */
+	XVIP_NL_ATTR_ENABLE,		/* u8 */
+	XVIP_NL_ATTR_ERROR,		/* s32 */
+	XVIP_NL_ATTR_ENTITIES,		/* u32 */
+	XVIP_NL_ATTR_GENERATION,	/* u32 */
+	XVIP_NL_ATTR_EVENTS,		/* u64 */
+	XVIP_NL_ATTR_FRAME_SYNCS,	/* u64 */
+	XVIP_NL_ATTR_CTRL_NOTIFIES,	/* u64 */
+	XVIP_NL_ATTR_PAD,
+	__XVIP_NL_ATTR_MAX,
+};
+
+#define XVIP_NL_ATTR_MAX	(__XVIP_NL_ATTR_MAX - 1)
+
+enum xvip_nl_state {
+	XVIP_NL_STATE_STOPPED,
+	XVIP_NL_STATE_STREAMING,
+	XVIP_NL_STATE_STANDBY,
+};
+
+#define XVIP_NL_STATS_DEFAULT_PERIOD_MS		1000
+
+static void xvip_stats_sum(struct xvip_composite_device *xdev,
+			   struct xvip_stats *total)
+{
+	const struct xvip_stats *stats;
+	int cpu;
+
+	memset(total, 0, sizeof(*total));
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(xdev->stats, cpu);
+		total->events += READ_ONCE(stats->events);
+		total->frame_syncs += READ_ONCE(stats->frame_syncs);
+		total->ctrl_notifies += READ_ONCE(stats->ctrl_notifies);
+	}
+}
+
+static u8 xvip_nl_state(struct xvip_composite_device *xdev)
+{
+	if (!xdev->is_streaming)
+		return XVIP_NL_STATE_STOPPED;
+
+	return xdev->standby ? XVIP_NL_STATE_STANDBY : XVIP_NL_STATE_STREAMING;
+}
+
+static int xvip_nl_fill(struct sk_buff *skb, struct xvip_composite_device *xdev,
+			u32 portid, u32 seq, int flags, u8 cmd, int error)
+{
+	struct xvip_stats total;
+	void *hdr;
+
+	hdr = genlmsg_put(skb, portid, seq, &xvip_nl_family, flags, cmd);
+	if (!hdr)
+		return -EMSGSIZE;
+
+	if (nla_put_string(skb, XVIP_NL_ATTR_DEVICE, dev_name(xdev->dev)) ||
+	    nla_put_u32(skb, XVIP_NL_ATTR_PARTITION, xdev->index) ||
+	    nla_put_u8(skb, XVIP_NL_ATTR_STATE, xvip_nl_state(xdev)))
+		goto error;
+
+	if (cmd == XVIP_NL_CMD_ERROR &&
+	    nla_put_s32(skb, XVIP_NL_ATTR_ERROR, error))
+		goto error;
+
+	if (cmd == XVIP_NL_CMD_QUERY || cmd == XVIP_NL_CMD_STATS) {
+		xvip_stats_sum(xdev, &total);
+
+		if (nla_put_u32(skb, XVIP_NL_ATTR_ENTITIES, xdev->num_subdevs) ||
+		    nla_put_u32(skb, XVIP_NL_ATTR_GENERATION,
+				atomic_read(&xdev->config_gen)) ||
+		    nla_put_u64_64bit(skb, XVIP_NL_ATTR_EVENTS, total.events,
+				      XVIP_NL_ATTR_PAD) ||
+		    nla_put_u64_64bit(skb, XVIP_NL_ATTR_FRAME_SYNCS,
+				      total.frame_syncs, XVIP_NL_ATTR_PAD) ||
+		    nla_put_u64_64bit(skb, XVIP_NL_ATTR_CTRL_NOTIFIES,
+				      total.ctrl_notifies, XVIP_NL_ATTR_PAD))
+			goto error;
+	}
+
+	genlmsg_end(skb, hdr);
+	return 0;
+
+error:
+	genlmsg_cancel(skb, hdr);
+	return -EMSGSIZE;
+}
+
+/* Multicast a state, error or statistics event to the listeners, if any. */
+static void xvip_nl_notify(struct xvip_composite_device *xdev, u8 cmd,
+			   int error)
+{
+	struct sk_buff *skb;
+
+	if (!genl_has_listeners(&xvip_nl_family, &init_net, 0))
+		return;
+
+	skb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+	if (!skb)
+		return;
+
+	if (xvip_nl_fill(skb, xdev, 0, 0, 0, cmd, error) < 0) {
+		nlmsg_free(skb);
+		return;
+	}
+
+	genlmsg_multicast(&xvip_nl_family, skb, 0, 0, GFP_KERNEL);
+}
+
+static void xvip_nl_notify_result(struct xvip_composite_device *xdev, int ret)
+{
+	if (ret < 0)
+		xvip_nl_notify(xdev, XVIP_NL_CMD_ERROR, ret);
+	xvip_nl_notify(xdev, XVIP_NL_CMD_STATE, 0);
+}
+
+static void xvip_nl_stats_work(struct kthread_work *work)
+{
+	struct xvip_composite_device *xdev =
+		container_of(work, struct xvip_composite_device,
+			     nl_stats_work.work);
+
+	xvip_nl_notify(xdev, XVIP_NL_CMD_STATS, 0);
+
+	kthread_queue_delayed_work(xdev->control_worker, &xdev->nl_stats_work,
+				   msecs_to_jiffies(xdev->nl_stats_period_ms));
+}
+
+/* -----------------------------------------------------------------------------
+ * Streaming
+ */
+
+/*
+ * Bound the CPU exit latency while the sensors are being started, so that
+ * the control bus transfers and frame-sync handling don't pay for deep idle
+ * states. Must be called with the device lock held.
+ */
+static void xvip_qos_get(struct xvip_composite_device *xdev)
+{
+	if (xdev->qos_latency_us < 0 ||
+	    cpu_latency_qos_request_active(&xdev->qos))
+		return;
+
+	cpu_latency_qos_add_request(&xdev->qos, xdev->qos_latency_us);
+}
+
+static void xvip_qos_put(struct xvip_composite_device *xdev)
+{
+	if (cpu_latency_qos_request_active(&xdev->qos))
+		cpu_latency_qos_remove_request(&xdev->qos);
+}
+
+/*
+ * Stop every streaming component, sources first, and release its entities from
+ * the media pipeline. Must be called with the device lock held.
+ */
+static void xvip_pipeline_stop_all(struct xvip_composite_device *xdev)
+{
+	struct xvip_component *component;
+	struct media_entity *source;
+	unsigned int i, j;
+
+	for (i = 0; i < xdev->num_components; i++) {
+		component = &xdev->components[i];
+		if (component->source == XVIP_NO_ENTITY)
+			continue;
+
+		source = xdev->entities[component->source].entity;
+		if (source->pipe != &xdev->pipe)
+			continue;
+
+		for (j = 0; j < component->num_entities; j++)
+			xvip_entity_start_stop(xdev, &xdev->entities[
+				xdev->start_order[component->first + j]], false);
+
+		media_pipeline_stop(source);
+	}
+
+	xdev->is_streaming = false;
+	xdev->standby = false;
+	xvip_icc_update(xdev);
+	xvip_qos_put(xdev);
+}
+
+/*
+ * Start the media pipeline of every connected component from its source and
+ * prepare its entities, downstream first. If an entity fails to prepare,
+ * everything is stopped and the error returned. Must be called with the device
+ * lock held.
+ */
+static int xvip_stream_prepare(struct xvip_composite_device *xdev)
+{
+	struct xvip_component *component;
+	struct xvip_graph_entity *entity;
+	struct media_entity *source;
+	unsigned int i, j;
+	int ret;
+
+	xvip_qos_get(xdev);
+
+	ret = xvip_pipeline_validate(xdev);
+	if (ret < 0)
+		goto error;
+
+	ret = xvip_components_update(xdev);
+	if (ret < 0)
+		goto error;
+
+	for (i = 0; i < xdev->num_components; i++) {
+		component = &xdev->components[i];
+		if (component->source == XVIP_NO_ENTITY)
+			continue;
+
+		source = xdev->entities[component->source].entity;
+		if (source->pipe)
+			continue;
+
+		ret = media_pipeline_start(source, &xdev->pipe);
+		if (ret < 0) {
+			dev_err(xdev->dev, "failed to start pipeline from %s\n",
+				source->name);
+			xvip_pipeline_stop_all(xdev);
+			return ret;
+		}
+
+		for (j = component->num_entities; j--; ) {
+			entity = &xdev->entities[
+				xdev->start_order[component->first + j]];
+			ret = xvip_entity_prepare(xdev, entity);
+			if (ret < 0) {
+				dev_err(xdev->dev, "failed to prepare %s\n",
+					entity->entity->name);
+				xvip_pipeline_stop_all(xdev);
+				return ret;
+			}
+		}
+	}
+
+	/* Raise the bandwidth vote before the traffic starts. */
+	xvip_icc_update(xdev);
+
+	return 0;
+
+error:
+	if (!xdev->is_streaming)
+		xvip_qos_put(xdev);
+	return ret;
+}
+
+/*
+ * Start streaming on the prepared entities, downstream first. On error, stop
+ * everything, so that the next start retries from scratch, and return it.
+ * Must be called with the device lock held.
+ */
+static int xvip_stream_commit(struct xvip_composite_device *xdev)
+{
+	struct xvip_component *component;
+	struct xvip_graph_entity *entity;
+	unsigned int i, j;
+	int ret;
+
+	for (i = 0; i < xdev->num_components; i++) {
+		component = &xdev->components[i];
+		if (component->source == XVIP_NO_ENTITY ||
+		    xdev->entities[component->source].entity->pipe != &xdev->pipe)
+			continue;
+
+		for (j = component->num_entities; j--; ) {
+			entity = &xdev->entities[
+				xdev->start_order[component->first + j]];
+			if (!entity->prepared)
+				continue;
+
+			ret = xvip_entity_commit(xdev, entity);
+			if (ret < 0) {
+				xvip_pipeline_stop_all(xdev);
+				return ret;
+			}
+		}
+	}
+	xdev->is_streaming = true;
+
+	if (!xdev->qos_streaming)
+		xvip_qos_put(xdev);
+
+	return 0;
+}
+
+static int xvip_start_stream(struct xvip_composite_device *xdev)
+{
+	int ret;
+
+	dev_dbg(xdev->dev, "Starting the stream \n");
+	mutex_lock(&xdev->lock);
+
+	/*
+	 * Start one media pipeline per connected component, from its source.
+	 * Entities are started downstream first. An armed scheduled start owns
+	 * the pipelines until it commits or the stream is stopped.
+	 */
+	ret = xdev->start_scheduled ? -EBUSY : xvip_stream_prepare(xdev);
+	if (!ret)
+		ret = xvip_stream_commit(xdev);
+
+	mutex_unlock(&xdev->lock);
+
+	xvip_nl_notify_result(xdev, ret);
+
+	return ret;
+}
+
+static int xvip_stop_stream(struct xvip_composite_device *xdev)
+{
+	dev_dbg(xdev->dev, "Stopping the stream\n");
+
+	/* Don't let a pending scheduled start commit after the stop. */
+	hrtimer_cancel(&xdev->start_timer);
+	cancel_work_sync(&xdev->sync_work);
+
+	mutex_lock(&xdev->lock);
+	xdev->start_scheduled = false;
+	xvip_pipeline_stop_all(xdev);
+	mutex_unlock(&xdev->lock);
+
+	xvip_nl_notify(xdev, XVIP_NL_CMD_STATE, 0);
+
+	return 0;
+}
+
+/*
+ * Put the started entities in standby for the user, sources first, or bring
+ * them back, downstream first. They stay powered and configured in standby,
+ * and entities throttled to standby for temperature stay there. The CPU
+ * latency request and the bandwidth vote follow the streaming sources.
+ */
+static int xvip_stream_standby(struct xvip_composite_device *xdev,
+			       bool standby)
+{
+	struct xvip_component *component;
+	struct xvip_graph_entity *entity;
+	unsigned int i, j, k;
+	int ret = 0;
+	int err;
+
+	mutex_lock(&xdev->lock);
+
+	if (!xdev->is_streaming || xdev->standby == standby) {
+		ret = xdev->is_streaming ? 0 : -EINVAL;
+		goto done;
+	}
+
+	for (i = 0; i < xdev->num_components; i++) {
+		component = &xdev->components[i];
+		if (component->source == XVIP_NO_ENTITY ||
+		    xdev->entities[component->source].entity->pipe != &xdev->pipe)
+			continue;
+
+		for (j = 0; j < component->num_entities; j++) {
+			k = standby ? j : component->num_entities - 1 - j;
+			entity = &xdev->entities[
+				xdev->start_order[component->first + k]];
+			if (!entity->prepared)
+				continue;
+
+			err = xvip_entity_standby(xdev, entity,
+						  XVIP_STANDBY_USER, standby);
+			if (err < 0 && !ret)
+				ret = err;
+		}
+	}
+
+	xvip_icc_update(xdev);
+
+	/* Keep the previous state on error, so that the switch can be retried. */
+	if (ret < 0)
+		goto done;
+
+	xdev->standby = standby;
+	if (standby)
+		xvip_qos_put(xdev);
+	else if (xdev->qos_streaming)
+		xvip_qos_get(xdev);
+
+done:
+	mutex_unlock(&xdev->lock);
+
+	xvip_nl_notify_result(xdev, ret);
+
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * Sync Groups
+ *
+ * Composite devices, typically one per FPGA, can be grouped by name through
+ * the "topic,sync-group" property or the sync_group attribute. Starting a
+ * group prepares the pipelines of all members, everything but s_stream, then
+ * commits them from one work item per member, each sleeping on an hrtimer
+ * until a common deadline, and reports the spread of the commit times.
+ */
+
+#define XVIP_SYNC_DEFAULT_LEAD_US	10000
+
+static void xvip_sync_work(struct work_struct *work)
+{
+	struct xvip_composite_device *xdev =
+		container_of(work, struct xvip_composite_device, sync_work);
+	ktime_t deadline = xdev->sync_deadline;
+
+	set_current_state(TASK_UNINTERRUPTIBLE);
+	schedule_hrtimeout_range_clock(&deadline, 0, HRTIMER_MODE_ABS,
+				       xdev->sync_clock);
+
+	mutex_lock(&xdev->lock);
+	xdev->commit_time = xdev->sync_clock == CLOCK_TAI ?
+			    ktime_get_clocktai() : ktime_get();
+	xdev->commit_result = xvip_stream_commit(xdev);
+
+	if (xdev->start_scheduled) {
+		xdev->start_scheduled = false;
+		dev_info(xdev->dev, "scheduled start %s, %lld ns late\n",
+			 xdev->commit_result < 0 ? "failed" : "committed",
+			 ktime_to_ns(ktime_sub(xdev->commit_time, deadline)));
+	}
+	mutex_unlock(&xdev->lock);
+
+	xvip_nl_notify_result(xdev, xdev->commit_result);
+}
+
+/* Must be called with the sync lock held. */
+static void xvip_sync_group_leave(struct xvip_composite_device *xdev)
+{
+	struct xvip_sync_group *group = xdev->sync_group;
+	struct xvip_composite_device *part;
+
+	if (!group)
+		return;
+
+	list_for_each_entry(part, &xdev->partitions, partition) {
+		list_del(&part->sync_entry);
+		part->sync_group = NULL;
+	}
+
+	if (list_empty(&group->members)) {
+		list_del(&group->list);
+		kfree(group->name);
+		kfree(group);
+	}
+}
+
+/*
+ * Add all the partitions of @xdev to the group called @name, created if
+ * needed. Must be called with the sync lock held.
+ */
+static int xvip_sync_group_join(struct xvip_composite_device *xdev,
+				const char *name)
+{
+	struct xvip_sync_group *group;
+	struct xvip_composite_device *part;
+
+	xvip_sync_group_leave(xdev);
+
+	list_for_each_entry(group, &xvip_sync_groups, list) {
+		if (!strcmp(group->name, name))
+			goto join;
+	}
+
+	group = kzalloc(sizeof(*group), GFP_KERNEL);
+	if (!group)
+		return -ENOMEM;
+
+	group->name = kstrdup(name, GFP_KERNEL);
+	if (!group->name) {
+		kfree(group);
+		return -ENOMEM;
+	}
+
+	INIT_LIST_HEAD(&group->members);
+	list_add_tail(&group->list, &xvip_sync_groups);
+
+join:
+	list_for_each_entry(part, &xdev->partitions, partition) {
+		part->sync_group = group;
+		list_add_tail(&part->sync_entry, &group->members);
+	}
+
+	return 0;
+}
+
+/**
+ * xvip_sync_group_start - Start the streams of all members of a sync group
+ * @group: Sync group
+ * @lead_us: time between the end of the preparation and the commit
+ *
+ * Must be called with the sync lock held. Members fail to start together: if
+ * any of them can't be prepared or committed, all of them are stopped.
+ *
+ * Return: 0 on success or a negative error code
+ */
+static int xvip_sync_group_start(struct xvip_sync_group *group,
+				 unsigned int lead_us)
+{
+	struct xvip_composite_device *xdev;
+	ktime_t first = KTIME_MAX;
+	ktime_t last = 0;
+	ktime_t deadline;
+	int ret = 0;
+
+	list_for_each_entry(xdev, &group->members, sync_entry) {
+		mutex_lock(&xdev->lock);
+		ret = xdev->start_scheduled ? -EBUSY : xvip_stream_prepare(xdev);
+		mutex_unlock(&xdev->lock);
+		if (ret < 0) {
+			dev_err(xdev->dev, "sync group %s: prepare failed\n",
+				group->name);
+			goto error;
+		}
+	}
+
+	deadline = ktime_add_us(ktime_get(), lead_us);
+
+	list_for_each_entry(xdev, &group->members, sync_entry) {
+		xdev->sync_deadline = deadline;
+		xdev->sync_clock = CLOCK_MONOTONIC;
+		queue_work(system_highpri_wq, &xdev->sync_work);
+	}
+
+	list_for_each_entry(xdev, &group->members, sync_entry) {
+		flush_work(&xdev->sync_work);
+
+		if (xdev->commit_result < 0 && !ret)
+			ret = xdev->commit_result;
+		first = min(first, xdev->commit_time);
+		last = max(last, xdev->commit_time);
+	}
+
+	if (ret < 0)
+		goto error;
+
+	group->skew = ktime_sub(last, first);
+
+	list_for_each_entry(xdev, &group->members, sync_entry)
+		dev_dbg(xdev->dev, "sync group %s: committed %lld ns late\n",
+			group->name,
+			ktime_to_ns(ktime_sub(xdev->commit_time, deadline)));
+
+	xdev = list_first_entry(&group->members, struct xvip_composite_device,
+				sync_entry);
+	dev_info(xdev->dev, "sync group %s started, skew %lld ns\n",
+		 group->name, ktime_to_ns(group->skew));
+
+	return 0;
+
+error:
+	list_for_each_entry(xdev, &group->members, sync_entry)
+		xvip_stop_stream(xdev);
+
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * Scheduled Start
+ *
+ * A stream can be armed to start at an absolute CLOCK_TAI or CLOCK_MONOTONIC
+ * time. The pipeline is prepared right away, and an hrtimer expiring slightly
+ * ahead of the requested time queues the commit work, which then sleeps until
+ * the exact time as for sync groups. The commit time error is logged and
+ * reported by the scheduled_start attribute.
+ */
+
+#define XVIP_SCHED_WAKEUP_US		200
+
+static enum hrtimer_restart xvip_start_timer(struct hrtimer *timer)
+{
+	struct xvip_composite_device *xdev =
+		container_of(timer, struct xvip_composite_device, start_timer);
+
+	queue_work(system_highpri_wq, &xdev->sync_work);
+
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * xvip_schedule_start - Arm the stream to start at a given time
+ * @xdev: Composite video device
+ * @clock: CLOCK_TAI or CLOCK_MONOTONIC
+ * @time: absolute start time on @clock
+ *
+ * Return: 0 on success or a negative error code
+ */
+static int xvip_schedule_start(struct xvip_composite_device *xdev,
+			       clockid_t clock, ktime_t time)
+{
+	ktime_t now;
+	int ret;
+
+	mutex_lock(&xdev->lock);
+
+	if (xdev->start_scheduled || xdev->is_streaming) {
+		ret = -EBUSY;
+		goto done;
+	}
+
+	now = clock == CLOCK_TAI ? ktime_get_clocktai() : ktime_get();
+	if (ktime_before(time, now)) {
+		ret = -ETIME;
+		goto done;
+	}
+
+	ret = xvip_stream_prepare(xdev);
+	if (ret < 0)
+		goto done;
+
+	xdev->sync_deadline = time;
+	xdev->sync_clock = clock;
+	xdev->start_scheduled = true;
+
+	/* The timer is bound to a clock, set it up for this start. */
+	hrtimer_init(&xdev->start_timer, clock, HRTIMER_MODE_ABS);
+	xdev->start_timer.function = xvip_start_timer;
+	hrtimer_start(&xdev->start_timer,
+		      ktime_sub_us(time, XVIP_SCHED_WAKEUP_US),
+		      HRTIMER_MODE_ABS);
+
+done:
+	mutex_unlock(&xdev->lock);
+
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * Control Worker
+ *
+ * Stream start and stop requests and the thermal throttling run on a
+ * dedicated kthread worker rather than in the context of the writer, with a
+ * scheduling policy and CPU affinity set from the "topic,control-policy" and
+ * "topic,control-cpus" properties or the corresponding attributes. Only the
+ * policies the scheduler exports to modules are available: SCHED_NORMAL, and
+ * SCHED_FIFO at the low or default real-time priority.
+ */
+
+static const char * const xvip_control_policies[] = {
+	[XVIP_CONTROL_NORMAL] = "normal",
+	[XVIP_CONTROL_FIFO_LOW] = "fifo_low",
+	[XVIP_CONTROL_FIFO] = "fifo",
+};
+
+struct xvip_control_work {
+	struct kthread_work work;
+	struct xvip_composite_device *xdev;
+	bool enable;
+	int result;
+};
+
+static void xvip_control_stream_work(struct kthread_work *work)
+{
+	struct xvip_control_work *cw =
+		container_of(work, struct xvip_control_work, work);
+	struct xvip_composite_device *part;
+
+	/* Partitions are started and stopped together. */
+	list_for_each_entry(part, &cw->xdev->partitions, partition) {
+		if (cw->enable)
+			cw->result = xvip_start_stream(part);
+		else
+			cw->result = xvip_stop_stream(part);
+		if (cw->result < 0)
+			break;
+	}
+}
+
+/* Start or stop the stream from the control worker and wait for the result. */
+static int xvip_control_stream(struct xvip_composite_device *xdev, bool enable)
+{
+	struct xvip_control_work cw = {
+		.xdev = xdev,
+		.enable = enable,
+	};
+
+	kthread_init_work(&cw.work, xvip_control_stream_work);
+	kthread_queue_work(xdev->control_worker, &cw.work);
+	kthread_flush_work(&cw.work);
+
+	return cw.result;
+}
+
+static int xvip_control_apply(struct xvip_composite_device *xdev)
+{
+	struct task_struct *task = xdev->control_worker->task;
+
+	switch (xdev->control_policy) {
+	case XVIP_CONTROL_NORMAL:
+		sched_set_normal(task, 0);
+		break;
+	case XVIP_CONTROL_FIFO_LOW:
+		sched_set_fifo_low(task);
+		break;
+	case XVIP_CONTROL_FIFO:
+		sched_set_fifo(task);
+		break;
+	}
+
+	return set_cpus_allowed_ptr(task, cpumask_empty(&xdev->control_cpus) ?
+				    cpu_possible_mask : &xdev->control_cpus);
+}
+
+static int xvip_control_init(struct xvip_composite_device *xdev)
+{
+	struct device_node *node = xdev->dev->of_node;
+	struct property *prop;
+	const char *policy;
+	const __be32 *p;
+	u32 cpu;
+	int ret;
+
+	mutex_init(&xdev->control_lock);
+
+	if (!of_property_read_string(node, "topic,control-policy", &policy)) {
+		ret = match_string(xvip_control_policies,
+				   ARRAY_SIZE(xvip_control_policies), policy);
+		if (ret < 0)
+			dev_warn(xdev->dev, "unknown control policy %s\n",
+				 policy);
+		else
+			xdev->control_policy = ret;
+	}
+
+	of_property_for_each_u32(node, "topic,control-cpus", prop, p, cpu) {
+		if (cpu < nr_cpu_ids)
+			cpumask_set_cpu(cpu, &xdev->control_cpus);
+	}
+
+	xdev->control_worker = kthread_create_worker(0, "%s",
+						     dev_name(xdev->dev));
+	if (IS_ERR(xdev->control_worker)) {
+		ret = PTR_ERR(xdev->control_worker);
+		xdev->control_worker = NULL;
+		return ret;
+	}
+
+	ret = xvip_control_apply(xdev);
+	if (ret < 0)
+		dev_warn(xdev->dev, "failed to set control worker affinity\n");
+
+	return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Generic Netlink Commands
+ */
+
+/*
+ * Look up the device named by XVIP_NL_ATTR_DEVICE and hold it until
+ * xvip_nl_put_device(). The devices lock is only held for the lookup, the
+ * command runs without it, and the device removal waits for the command.
+ */
+static struct xvip_composite_device *xvip_nl_get_device(struct genl_info *info)
+{
+	struct xvip_composite_device *xdev;
+
+	if (!info->attrs[XVIP_NL_ATTR_DEVICE])
+		return ERR_PTR(-EINVAL);
+
+	mutex_lock(&xvip_devices_lock);
+
+	list_for_each_entry(xdev, &xvip_devices, device_entry) {
+		if (!nla_strcmp(info->attrs[XVIP_NL_ATTR_DEVICE],
+				dev_name(xdev->dev))) {
+			atomic_inc(&xdev->nl_users);
+			mutex_unlock(&xvip_devices_lock);
+			return xdev;
+		}
+	}
+
+	mutex_unlock(&xvip_devices_lock);
+
+	return ERR_PTR(-ENODEV);
+}
+
+static void xvip_nl_put_device(struct xvip_composite_device *xdev)
+{
+	if (atomic_dec_and_test(&xdev->nl_users))
+		wake_up(&xdev->nl_wq);
+}
+
+static int xvip_nl_stream(struct sk_buff *skb, struct genl_info *info)
+{
+	struct xvip_composite_device *xdev;
+	int ret;
+
+	xdev = xvip_nl_get_device(info);
+	if (IS_ERR(xdev))
+		return PTR_ERR(xdev);
+
+	ret = xvip_control_stream(xdev,
+				  info->genlhdr->cmd == XVIP_NL_CMD_START);
+
+	xvip_nl_put_device(xdev);
+	return ret;
+}
+
+static int xvip_nl_standby(struct sk_buff *skb, struct genl_info *info)
+{
+	struct xvip_composite_device *xdev;
+	struct xvip_composite_device *part;
+	bool standby = true;
+	int ret = 0;
+
+	if (info->attrs[XVIP_NL_ATTR_ENABLE])
+		standby = nla_get_u8(info->attrs[XVIP_NL_ATTR_ENABLE]);
+
+	xdev = xvip_nl_get_device(info);
+	if (IS_ERR(xdev))
+		return PTR_ERR(xdev);
+
+	list_for_each_entry(part, &xdev->partitions, partition) {
+		ret = xvip_stream_standby(part, standby);
+		if (ret < 0)
+			break;
+	}
+
+	xvip_nl_put_device(xdev);
+	return ret;
+}
+
+/*
+ * Dump the state and statistics of every partition of every device, or of the
+ * device named by XVIP_NL_ATTR_DEVICE. cb->args hold the index of the next
+ * device and partition to dump.
+ */
+static int xvip_nl_query_dump(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	const struct genl_dumpit_info *info = genl_dumpit_info(cb);
+	struct nlattr *name = info->attrs[XVIP_NL_ATTR_DEVICE];
+	struct xvip_composite_device *xdev;
+	struct xvip_composite_device *part;
+	unsigned long d = 0;
+	unsigned long p;
+
+	mutex_lock(&xvip_devices_lock);
+
+	list_for_each_entry(xdev, &xvip_devices, device_entry) {
+		if (d < cb->args[0]) {
+			d++;
+			continue;
+		}
+
+		if (!name || !nla_strcmp(name, dev_name(xdev->dev))) {
+			p = 0;
+			list_for_each_entry(part, &xdev->partitions, partition) {
+				if (p < cb->args[1]) {
+					p++;
+					continue;
+				}
+
+				if (xvip_nl_fill(skb, part,
+						 NETLINK_CB(cb->skb).portid,
+						 cb->nlh->nlmsg_seq, NLM_F_MULTI,
+						 XVIP_NL_CMD_QUERY, 0) < 0)
+					goto done;
+
+				cb->args[1] = ++p;
+			}
+		}
+
+		cb->args[0] = ++d;
+		cb->args[1] = 0;
+	}
+
+done:
+	mutex_unlock(&xvip_devices_lock);
+	return skb->len;
+}
+
+static const struct nla_policy xvip_nl_policy[XVIP_NL_ATTR_MAX + 1] = {
+	[XVIP_NL_ATTR_DEVICE] = { .type = NLA_NUL_STRING },
+	[XVIP_NL_ATTR_ENABLE] = { .type = NLA_U8 },
+};
+
+static const struct genl_ops xvip_nl_ops[] = {
+	{
+		.cmd = XVIP_NL_CMD_START,
+		.doit = xvip_nl_stream,
+		.flags = GENL_ADMIN_PERM,
+	},
+	{
+		.cmd = XVIP_NL_CMD_STOP,
+		.doit = xvip_nl_stream,
+		.flags = GENL_ADMIN_PERM,
+	},
+	{
+		.cmd = XVIP_NL_CMD_STANDBY,
+		.doit = xvip_nl_standby,
+		.flags = GENL_ADMIN_PERM,
+	},
+	{
+		.cmd = XVIP_NL_CMD_QUERY,
+		.dumpit = xvip_nl_query_dump,
+	},
+};
+
+static const struct genl_multicast_group xvip_nl_mcgrps[] = {
+	{ .name = "events" },
+};
+
+static struct genl_family xvip_nl_family __ro_after_init = {
+	.name = "topic-mediactl",
+	.version = 1,
+	.maxattr = XVIP_NL_ATTR_MAX,
+	.policy = xvip_nl_policy,
+	.module = THIS_MODULE,
+	.ops = xvip_nl_ops,
+	.n_ops = ARRAY_SIZE(xvip_nl_ops),
+	.mcgrps = xvip_nl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(xvip_nl_mcgrps),
+};
+
+/* -----------------------------------------------------------------------------
+ * Media Controller and V4L2
+ */
+
+static void xvip_composite_v4l2_cleanup(struct xvip_composite_device *xdev)
+{
+	v4l2_device_unregister(&xdev->v4l2_dev);
+	media_device_unregister(&xdev->media_dev);
+	media_device_cleanup(&xdev->media_dev);
+}
+
+static int xvip_composite_v4l2_init(struct xvip_composite_device *xdev)
+{
+	int ret;
+
+	xdev->media_dev.dev = xdev->dev;
+	strscpy(xdev->media_dev.model, "Xilinx Video Composite Device",
+		sizeof(xdev->media_dev.model));
+	xdev->media_dev.hw_revision = 0;
+	xdev->media_dev.ops = &xvip_media_ops;
+
+	media_device_init(&xdev->media_dev);
+
+	xdev->v4l2_dev.mdev = &xdev->media_dev;
+	xdev->v4l2_dev.notify = xvip_v4l2_notify;
+	ret = v4l2_device_register(xdev->dev, &xdev->v4l2_dev);
+	if (ret < 0) {
+		dev_err(xdev->dev, "V4L2 device registration failed (%d)\n",
+			ret);
+		media_device_cleanup(&xdev->media_dev);
+		return ret;
+	}
+
+	return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Graph Partitioning
+ *
+ * With the "topic,partition-components" property, physically independent
+ * parts of the graph are registered as separate media devices, so that their
+ * clients don't share the graph mutex and topology of a single media device.
+ * The async subdevs of each disconnected part of the graph are moved to the
+ * notifier of a new composite device before the notifiers are registered.
+ */
+
+static int xvip_composite_setup(struct xvip_composite_device *xdev,
+				struct device *dev)
+{
+	xdev->stats = devm_alloc_percpu(dev, struct xvip_stats);
+	if (!xdev->stats)
+		return -ENOMEM;
+
+	xdev->dev = dev;
+	xdev->probe_time = ktime_get();
+	INIT_LIST_HEAD(&xdev->partitions);
+	INIT_LIST_HEAD(&xdev->partition);
+	mutex_init(&xdev->lock);
+	init_waitqueue_head(&xdev->frame_wq);
+	init_waitqueue_head(&xdev->nl_wq);
+	INIT_LIST_HEAD(&xdev->requests);
+	spin_lock_init(&xdev->requests_lock);
+	INIT_WORK(&xdev->request_work, xvip_request_work);
+	INIT_LIST_HEAD(&xdev->profiles);
+	atomic_set(&xdev->config_gen, 1);
+	INIT_WORK(&xdev->validate_work, xvip_pipeline_validate_work);
+	INIT_LIST_HEAD(&xdev->sync_entry);
+	INIT_WORK(&xdev->sync_work, xvip_sync_work);
+	xdev->qos_latency_us = -1;
+	of_property_read_s32(dev->of_node, "topic,cpu-latency-us",
+			     &xdev->qos_latency_us);
+	xdev->qos_streaming = of_property_read_bool(dev->of_node,
+				"topic,cpu-latency-while-streaming");
+	INIT_LIST_HEAD(&xdev->device_entry);
+	kthread_init_delayed_work(&xdev->nl_stats_work, xvip_nl_stats_work);
+	xdev->nl_stats_period_ms = XVIP_NL_STATS_DEFAULT_PERIOD_MS;
+	of_property_read_u32(dev->of_node, "topic,netlink-stats-period-ms",
+			     &xdev->nl_stats_period_ms);
+	INIT_LIST_HEAD(&xdev->thermals);
+	kthread_init_delayed_work(&xdev->thermal_work, xvip_thermal_work);
+	hrtimer_init(&xdev->start_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	xdev->start_timer.function = xvip_start_timer;
+	of_property_read_u32(dev->of_node, "topic,group-hold-control",
+			     &xdev->group_hold_cid);
+	v4l2_async_notifier_init(&xdev->notifier);
+
+	return 0;
+}
+
+static struct xvip_composite_device *
+xvip_partition_create(struct xvip_composite_device *xdev)
+{
+	struct xvip_composite_device *part;
+	int ret;
+
+	part = devm_kzalloc(xdev->dev, sizeof(*part), GFP_KERNEL);
+	if (!part)
+		return ERR_PTR(-ENOMEM);
+
+	ret = xvip_composite_setup(part, xdev->dev);
+	if (ret < 0)
+		return ERR_PTR(ret);
+
+	part->control_worker = xdev->control_worker;
+	part->index = list_last_entry(&xdev->partitions,
+				      struct xvip_composite_device,
+				      partition)->index + 1;
+	snprintf(part->v4l2_dev.name, sizeof(part->v4l2_dev.name), "%s.%u",
+		 dev_name(xdev->dev), part->index);
+
+	ret = xvip_ctrl_cache_parse(part);
+	if (ret < 0)
+		return ERR_PTR(ret);
+
+	ret = xvip_icc_init(part);
+	if (ret < 0)
+		return ERR_PTR(ret);
+
+	ret = xvip_composite_v4l2_init(part);
+	if (ret < 0) {
+		icc_put(part->icc_path);
+		return ERR_PTR(ret);
+	}
+
+	list_add_tail(&part->partition, &xdev->partitions);
+
+	return part;
+}
+
+static int xvip_graph_partition(struct xvip_composite_device *xdev)
+{
+	struct xvip_composite_device **parts = NULL;
+	struct v4l2_async_subdev **asds;
+	struct v4l2_async_subdev *asd;
+	struct fwnode_handle *remote;
+	struct fwnode_handle *ep;
+	unsigned int *parent;
+	unsigned int count = 0;
+	unsigned int i, j, root;
+	int ret = 0;
+
+	list_for_each_entry(asd, &xdev->notifier.asd_list, asd_list)
+		count++;
+
+	asds = kcalloc(count, sizeof(*asds), GFP_KERNEL);
+	parent = kcalloc(count, sizeof(*parent), GFP_KERNEL);
+	parts = kcalloc(count, sizeof(*parts), GFP_KERNEL);
+	if (!asds || !parent || !parts) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	i = 0;
+	list_for_each_entry(asd, &xdev->notifier.asd_list, asd_list) {
+		parent[i] = i;
+		asds[i++] = asd;
+	}
+
+	/* Merge the entities connected through an endpoint. */
+	for (i = 0; i < count; i++) {
+		fwnode_graph_for_each_endpoint(asds[i]->match.fwnode, ep) {
+			remote = fwnode_graph_get_remote_port_parent(ep);
+			for (j = 0; j < count; j++)
+				if (asds[j]->match.fwnode == remote)
+					break;
+			fwnode_handle_put(remote);
+
+			if (j < count)
+				parent[xvip_uf_find(parent, i)] =
+					xvip_uf_find(parent, j);
+		}
+	}
+
+	/*
+	 * The component of the first async subdev stays with the platform
+	 * device, every other one gets a new composite device.
+	 */
+	parts[xvip_uf_find(parent, 0)] = xdev;
+
+	for (i = 1; i < count; i++) {
+		root = xvip_uf_find(parent, i);
+		if (!parts[root]) {
+			parts[root] = xvip_partition_create(xdev);
+			if (IS_ERR(parts[root])) {
+				ret = PTR_ERR(parts[root]);
+				goto done;
+			}
+		}
+
+		if (parts[root] != xdev)
+			list_move_tail(&asds[i]->asd_list,
+				       &parts[root]->notifier.asd_list);
+	}
+
+	if (!list_is_singular(&xdev->partitions))
+		dev_info(xdev->dev, "graph partitioned in %u media devices\n",
+			 list_last_entry(&xdev->partitions,
+					 struct xvip_composite_device,
+					 partition)->index + 1);
+
+done:
+	kfree(parts);
+	kfree(parent);
+	kfree(asds);
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * Graph Notifier
+ */
+
+static int xvip_graph_notify_complete(struct v4l2_async_notifier *notifier)
+{
+	struct xvip_composite_device *xdev =
+		container_of(notifier, struct xvip_composite_device, notifier);
+	unsigned int i;
+	int ret;
+
+	dev_dbg(xdev->dev, "notify complete, all subdevs registered\n");
+
+	mutex_lock(&xdev->lock);
+	xdev->num_subdevs = xdev->entities_size;
+	mutex_unlock(&xdev->lock);
+
+	/* Create links for every entity. */
+	if (xdev->fw_links) {
+		ret = xvip_graph_build_fw(xdev);
+		if (ret < 0)
+			return ret;
+	} else {
+		for (i = 0; i < xdev->num_subdevs; i++) {
+			ret = xvip_graph_build_one(xdev,
+						   &xdev->entities[i]);
+			if (ret < 0)
+				return ret;
+		}
+	}
+
+	dev_dbg(xdev->dev, "Going to register v4l2 device \n");
+
+	xvip_graph_select_subdev_nodes(xdev);
+	ret = v4l2_device_register_subdev_nodes(&xdev->v4l2_dev);
+	if (ret < 0)
+		dev_err(xdev->dev, "failed to register subdev nodes\n");
+
+	ret = xvip_ctrl_cache_init(xdev);
+	if (ret < 0)
+		dev_err(xdev->dev, "failed to set up the control cache\n");
+
+	xvip_profiles_init(xdev);
+	xvip_thermal_init(xdev);
+
+	mutex_lock(&xdev->lock);
+	xvip_pipeline_validate(xdev);
+	mutex_unlock(&xdev->lock);
+
+	ret = media_device_register(&xdev->media_dev);
+	if (ret < 0)
+		return ret;
+
+	dev_dbg(xdev->dev, "media device registered %lld us after probe\n",
+		ktime_us_delta(ktime_get(), xdev->probe_time));
+
+	xvip_topology_uevent(xdev, "ready");
+
+	return 0;
+}
+
+static int xvip_graph_notify_bound(struct v4l2_async_notifier *notifier,
+				   struct v4l2_subdev *subdev,
+				   struct v4l2_async_subdev *unused)
+{
+	struct xvip_composite_device *xdev =
+		container_of(notifier, struct xvip_composite_device, notifier);
+	struct xvip_graph_entity *entity;
+	struct xvip_graph_asd *xasd;
+	struct v4l2_async_subdev *asd;
+	unsigned int id;
+
+	/* Locate the entity corresponding to the bound subdev and store the
+	 * subdev pointer in the first free slot of the entities array.
+	 */
+	list_for_each_entry(asd, &xdev->notifier.asd_list, asd_list) {
+		xasd = to_xvip_asd(asd);
+		if (asd->match.fwnode != subdev->fwnode)
+			continue;
+
+		if (xasd->entity) {
+			dev_err(xdev->dev, "duplicate subdev for node %p\n",
+				asd->match.fwnode);
+			return -EINVAL;
+		}
+
+		for (id = 0; id < xdev->entities_size; id++)
+			if (!xdev->entities[id].subdev)
+				break;
+		if (id == xdev->entities_size)
+			return -ENOSPC;
+
+		//dev_dbg(xdev->dev, "subdev %s bound\n", subdev->name);
+		entity = &xdev->entities[id];
+		memset(entity, 0, sizeof(*entity));
+		entity->subdev = subdev;
+		entity->entity = &subdev->entity;
+		entity->fwnode = asd->match.fwnode;
+		v4l2_set_subdev_hostdata(subdev, entity);
+		xasd->entity = entity;
+		return 0;
+	}
+
+	dev_err(xdev->dev, "no entity for subdev %s\n", subdev->name);
+	return -EINVAL;
+}
+
+static void xvip_graph_notify_unbind(struct v4l2_async_notifier *notifier,
+				     struct v4l2_subdev *subdev,
+				     struct v4l2_async_subdev *asd)
+{
+	struct xvip_composite_device *xdev =
+		container_of(notifier, struct xvip_composite_device, notifier);
+	struct xvip_graph_asd *xasd = to_xvip_asd(asd);
+	bool complete;
+
+	/*
+	 * The control cache, the profiles and the thermal bindings hold
+	 * pointers to subdev objects, drop them with the first subdev. The
+	 * graph is incomplete from then on, hide the remaining entities until
+	 * it completes again.
+	 */
+	xvip_ctrl_cache_cleanup(xdev);
+	xvip_profiles_cleanup(xdev);
+	xvip_thermal_cleanup(xdev);
+
+	mutex_lock(&xdev->lock);
+	xvip_components_free(xdev);
+	complete = xdev->num_subdevs;
+	xdev->num_subdevs = 0;
+	if (xasd->entity) {
+		xasd->entity->subdev = NULL;
+		xasd->entity->entity = NULL;
+		xasd->entity = NULL;
+	}
+	mutex_unlock(&xdev->lock);
+
+	v4l2_set_subdev_hostdata(subdev, NULL);
+
+	if (complete)
+		xvip_topology_uevent(xdev, "incomplete");
+}
+
+static const struct v4l2_async_notifier_operations xvip_graph_notify_ops = {
 	.bound = xvip_graph_notify_bound,
+	.unbind = xvip_graph_notify_unbind,
 	.complete = xvip_graph_notify_complete,
 };
 
-static int xvip_graph_parse_one(struct xvip_composite_device *xdev,
-				struct fwnode_handle *fwnode)
+static int xvip_graph_parse_one(struct xvip_composite_device *xdev,
+				struct fwnode_handle *fwnode)
+{
+	struct fwnode_handle *remote;
+	struct fwnode_handle *ep = NULL;
+	int ret = 0;
+
+	//dev_dbg(xdev->dev, "parsing node %pOF\n", node);
+
+	while (1) {
+		struct v4l2_async_subdev *asd;
+		
+		ep = fwnode_graph_get_next_endpoint(fwnode, ep);
+		if (ep == NULL)
+			break;
+
+		//dev_dbg(xdev->dev, "handling endpoint %pOF\n", ep);
+
+		remote = fwnode_graph_get_remote_port_parent(ep);
+		if (remote == NULL) {
+			ret = -EINVAL;
+			goto err_notifier_cleanup;
+		}
+		
+		fwnode_handle_put(ep);
+
+		/* Skip entities that we have already processed. */
+		if (remote == of_fwnode_handle(xdev->dev->of_node) ||
+		    xvip_graph_find_asd(xdev, remote)) {
+			fwnode_handle_put(remote);
+			continue;
+		}
+
+		asd = v4l2_async_notifier_add_fwnode_subdev(
+			&xdev->notifier, remote,
+			sizeof(struct xvip_graph_asd));
+		fwnode_handle_put(remote);
+		if (IS_ERR(asd)) {
+			ret = PTR_ERR(asd);
+			goto err_notifier_cleanup;
+		}
+	}
+
+	return 0;
+
+err_notifier_cleanup:
+	v4l2_async_notifier_cleanup(&xdev->notifier);
+	fwnode_handle_put(ep);
+	return ret;
+}
+
+static int xvip_graph_parse(struct xvip_composite_device *xdev)
+{
+	struct v4l2_async_subdev *asd;
+	int ret;
+
+	/*
+	 * Walk the links to parse the full graph. Start by parsing the
+	 * composite node and then parse entities in turn. The list_for_each
+	 * loop will handle entities added at the end of the list while walking
+	 * the links.
+	 */
+	ret = xvip_graph_parse_one(xdev, of_fwnode_handle(xdev->dev->of_node));
+	if (ret < 0)
+		return 0;
+
+	list_for_each_entry(asd, &xdev->notifier.asd_list, asd_list) {
+		ret = xvip_graph_parse_one(xdev, asd->match.fwnode);
+		if (ret < 0) {
+			v4l2_async_notifier_cleanup(&xdev->notifier);
+			break;
+		}
+	}
+
+	return ret;
+}
+
+static void xvip_graph_cleanup(struct xvip_composite_device *xdev)
+{
+	v4l2_async_notifier_unregister(&xdev->notifier);
+	v4l2_async_notifier_cleanup(&xdev->notifier);
+	xvip_graph_free_entities(xdev);
+	kfree(xdev->fw_links);
+	xdev->fw_links = NULL;
+	xdev->num_fw_links = 0;
+}
+
+static void xvip_partitions_cleanup(struct xvip_composite_device *xdev)
+{
+	struct xvip_composite_device *part;
+	struct xvip_composite_device *next;
+
+	list_for_each_entry_safe(part, next, &xdev->partitions, partition) {
+		if (part == xdev)
+			continue;
+
+		xvip_graph_cleanup(part);
+		xvip_ctrl_cache_cleanup(part);
+		xvip_composite_v4l2_cleanup(part);
+		icc_put(part->icc_path);
+		list_del(&part->partition);
+	}
+}
+
+static int xvip_graph_init(struct xvip_composite_device *xdev)
+{
+	struct xvip_composite_device *part;
+	int ret;
+
+	/*
+	 * Use the precompiled graph description when there is a valid one,
+	 * otherwise parse the graph to extract a list of subdevice DT nodes.
+	 */
+	ret = xvip_graph_load_fw(xdev);
+	if (ret < 0)
+		ret = xvip_graph_parse(xdev);
+	if (ret < 0) {
+		dev_err(xdev->dev, "graph parsing failed\n");
+		goto done;
+	}
+
+	if (list_empty(&xdev->notifier.asd_list)) {
+		dev_err(xdev->dev, "no subdev found in graph\n");
+		goto done;
+	}
+
+	if (of_property_read_bool(xdev->dev->of_node,
+				  "topic,partition-components")) {
+		if (xdev->fw_links) {
+			dev_warn(xdev->dev,
+				 "not partitioning a graph loaded from firmware\n");
+		} else {
+			ret = xvip_graph_partition(xdev);
+			if (ret < 0)
+				goto done;
+		}
+	}
+
+	/* Register the subdevices notifier of every partition. */
+	list_for_each_entry(part, &xdev->partitions, partition) {
+		ret = xvip_graph_alloc_entities(part);
+		if (ret < 0)
+			goto done;
+
+		part->notifier.ops = &xvip_graph_notify_ops;
+
+		ret = v4l2_async_notifier_register(&part->v4l2_dev,
+						   &part->notifier);
+		if (ret < 0) {
+			dev_err(xdev->dev, "notifier registration failed\n");
+			goto done;
+		}
+	}
+
+	ret = 0;
+
+done:
+	if (ret < 0) {
+		xvip_partitions_cleanup(xdev);
+		xvip_graph_cleanup(xdev);
+	}
+
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * Sysfs Attributes
+ *
+ * The attributes belong to the platform device and cover all its partitions:
+ * lines naming entities are routed to the partition owning the entity, and
+ * the others apply to, or report, every partition.
+ */
+
+static ssize_t xvip_start_stream_show(
+	struct device *dev,
+	struct device_attribute *attr,
+	char *buf)
+{
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+	struct xvip_composite_device *part;
+	bool streaming = false;
+
+	list_for_each_entry(part, &xdev->partitions, partition)
+		streaming |= READ_ONCE(part->is_streaming);
+
+	return snprintf(buf, PAGE_SIZE, "%d\n", streaming);
+}
+
+static ssize_t xvip_start_stream_store(
+	struct device *dev,
+	struct device_attribute *attr,
+	const char *buf,
+	size_t count)
+{
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+	bool enable;
+	int ret;
+
+	/* Any write other than a boolean false starts the stream. */
+	if (kstrtobool(buf, &enable) < 0)
+		enable = true;
+
+	ret = xvip_control_stream(xdev, enable);
+	if (ret < 0)
+		return ret;
+
+	return count;
+}
+
+static DEVICE_ATTR(stream_start, S_IRUSR | S_IWUSR, xvip_start_stream_show, xvip_start_stream_store);
+
+static ssize_t ctrl_cache_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+	struct xvip_composite_device *part;
+	struct xvip_ctrl_cache_entry *entry;
+	ktime_t now = ktime_get();
+	ssize_t len = 0;
+	unsigned int i;
+
+	list_for_each_entry(part, &xdev->partitions, partition) {
+		spin_lock_irq(&part->ctrl_cache_lock);
+		for (i = 0; i < part->ctrl_cache_size; i++) {
+			entry = &part->ctrl_cache[i];
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+					 "%s\t0x%08x\t%lld\t%lld\n",
+					 entry->entity->entity->name,
+					 entry->ctrl->id, entry->value,
+					 ktime_ms_delta(now, entry->updated));
+		}
+		spin_unlock_irq(&part->ctrl_cache_lock);
+	}
+
+	return len;
+}
+
+static DEVICE_ATTR_RO(ctrl_cache);
+
+static ssize_t ctrl_cache_period_ms_show(struct device *dev,
+					 struct device_attribute *attr,
+					 char *buf)
+{
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+
+	return snprintf(buf, PAGE_SIZE, "%u\n", xdev->ctrl_cache_period_ms);
+}
+
+static ssize_t ctrl_cache_period_ms_store(struct device *dev,
+					  struct device_attribute *attr,
+					  const char *buf, size_t count)
+{
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+	struct xvip_composite_device *part;
+	unsigned int period;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &period);
+	if (ret < 0)
+		return ret;
+
+	list_for_each_entry(part, &xdev->partitions, partition) {
+		spin_lock_irq(&part->ctrl_cache_lock);
+		part->ctrl_cache_period_ms = period;
+		if (part->ctrl_cache_size)
+			mod_delayed_work(system_wq, &part->ctrl_cache_work, 0);
+		spin_unlock_irq(&part->ctrl_cache_lock);
+	}
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(ctrl_cache_period_ms);
+
+/*
+ * Apply the control updates of one partition as a batch. All the lines are
+ * parsed before any control is changed.
+ */
+static int xvip_ctrl_batch_write(struct xvip_composite_device *xdev,
+				 char *lines)
+{
+	struct xvip_ctrl_update *updates;
+	unsigned int num_updates = 0;
+	unsigned int max_updates;
+	char *pos, *line;
+	int ret;
+
+	/* Count the non-empty lines, there's nothing to wait for without any. */
+	max_updates = 0;
+	for (pos = lines; *pos; pos = line) {
+		line = strchrnul(pos, '\n');
+		if (skip_spaces(pos) < line)
+			max_updates++;
+		if (*line)
+			line++;
+	}
+
+	if (!max_updates)
+		return 0;
+
+	updates = kcalloc(max_updates, sizeof(*updates), GFP_KERNEL);
+	if (!updates)
+		return -ENOMEM;
+
+	mutex_lock(&xdev->lock);
+
+	pos = lines;
+	while ((line = strsep(&pos, "\n")) != NULL) {
+		if (!*skip_spaces(line))
+			continue;
+
+		ret = xvip_ctrl_update_parse(xdev, line,
+					     &updates[num_updates]);
+		if (ret < 0) {
+			dev_dbg(xdev->dev, "invalid control update '%s'\n",
+				line);
+			goto unlock;
+		}
+		num_updates++;
+	}
+
+	ret = xvip_ctrl_batch_apply(xdev, updates, num_updates);
+	xdev->active_profile = NULL;
+
+unlock:
+	mutex_unlock(&xdev->lock);
+	kfree(updates);
+	return ret;
+}
+
+/* The updates are applied in one frame, they can't span partitions. */
+static ssize_t ctrl_batch_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+	struct xvip_composite_device *part;
+	char *lines;
+	int ret;
+
+	part = xvip_config_partition(xdev, buf, count);
+	if (IS_ERR(part))
+		return PTR_ERR(part);
+
+	lines = kstrndup(buf, count, GFP_KERNEL);
+	if (!lines)
+		return -ENOMEM;
+
+	ret = xvip_ctrl_batch_write(part, lines);
+	kfree(lines);
+
+	return ret < 0 ? ret : count;
+}
+
+static DEVICE_ATTR_WO(ctrl_batch);
+
+/* One line per partition. */
+static ssize_t reconfigure_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+	struct xvip_composite_device *part;
+	ssize_t len = 0;
+
+	list_for_each_entry(part, &xdev->partitions, partition) {
+		mutex_lock(&part->lock);
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%u %lld %llu\n",
+				 part->reconfig_changes,
+				 ktime_to_us(part->reconfig_gap),
+				 part->reconfig_gap_frames);
+		mutex_unlock(&part->lock);
+	}
+
+	return len;
+}
+
+/* The settings are applied in one go, they can't span partitions. */
+static ssize_t reconfigure_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+	struct xvip_composite_device *part;
+	struct xvip_config *cfg;
+	int ret;
+
+	part = xvip_config_partition(xdev, buf, count);
+	if (IS_ERR(part))
+		return PTR_ERR(part);
+
+	mutex_lock(&part->lock);
+
+	cfg = xvip_config_parse(part, buf, count);
+	if (IS_ERR(cfg)) {
+		ret = PTR_ERR(cfg);
+	} else {
+		ret = xvip_reconfigure(part, cfg);
+		part->active_profile = NULL;
+		kfree(cfg);
+	}
+
+	mutex_unlock(&part->lock);
+
+	return ret < 0 ? ret : count;
+}
+
+static DEVICE_ATTR_RW(reconfigure);
+
+struct xvip_profile_name {
+	char *name;
+	bool active;
+};
+
+/*
+ * A profile spanning partitions is listed once, it is marked active if it is
+ * active in the first partition defining it. The distinct names are collected
+ * first, copied as the partitions are unlocked in turn.
+ */
+static ssize_t profile_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+	struct xvip_composite_device *part;
+	struct xvip_profile_name *names;
+	struct xvip_profile *profile;
+	unsigned int max_names = 0;
+	unsigned int num_names = 0;
+	unsigned int i;
+	ssize_t len = 0;
+
+	list_for_each_entry(part, &xdev->partitions, partition) {
+		mutex_lock(&part->lock);
+		list_for_each_entry(profile, &part->profiles, list)
+			max_names++;
+		mutex_unlock(&part->lock);
+	}
+
+	if (!max_names)
+		return 0;
+
+	names = kcalloc(max_names, sizeof(*names), GFP_KERNEL);
+	if (!names)
+		return -ENOMEM;
+
+	list_for_each_entry(part, &xdev->partitions, partition) {
+		mutex_lock(&part->lock);
+		list_for_each_entry(profile, &part->profiles, list) {
+			for (i = 0; i < num_names; i++) {
+				if (!strcmp(names[i].name, profile->name))
+					break;
+			}
+
+			/* Skip duplicates and profiles added since the count. */
+			if (i < num_names || num_names == max_names)
+				continue;
+
+			names[i].name = kstrdup(profile->name, GFP_KERNEL);
+			if (!names[i].name) {
+				len = -ENOMEM;
+				break;
+			}
+			names[i].active = profile == part->active_profile;
+			num_names++;
+		}
+		mutex_unlock(&part->lock);
+
+		if (len < 0)
+			break;
+	}
+
+	for (i = 0; i < num_names; i++) {
+		if (len >= 0)
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+					 names[i].active ? "[%s]\n" : "%s\n",
+					 names[i].name);
+		kfree(names[i].name);
+	}
+
+	kfree(names);
+	return len;
+}
+
+/* Switch every partition defining the profile. */
+static ssize_t profile_store(struct device *dev, struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+	struct xvip_composite_device *part;
+	bool found;
+	char *name;
+	int ret = -ENOENT;
+
+	name = kstrndup(buf, count, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+
+	strim(name);
+
+	list_for_each_entry(part, &xdev->partitions, partition) {
+		mutex_lock(&part->lock);
+		found = xvip_profile_find(part, name);
+		mutex_unlock(&part->lock);
+		if (!found)
+			continue;
+
+		mutex_lock(&part->lock);
+		ret = xvip_profile_switch(part, name);
+		mutex_unlock(&part->lock);
+		if (ret < 0)
+			break;
+	}
+
+	kfree(name);
+	return ret < 0 ? ret : count;
+}
+
+static DEVICE_ATTR_RW(profile);
+
+/*
+ * The first line is the profile name, the settings follow. A profile spanning
+ * partitions is defined in each of them with the settings of its entities.
+ */
+static ssize_t profile_define_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+	struct xvip_composite_device *part;
+	const char *settings;
+	bool defined = false;
+	char *lines;
+	char *name;
+	int ret = 0;
+
+	settings = strnchr(buf, count, '\n');
+	if (!settings)
+		return -EINVAL;
+
+	name = kstrndup(buf, settings - buf, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+
+	strim(name);
+	settings++;
+
+	list_for_each_entry(part, &xdev->partitions, partition) {
+		lines = xvip_config_filter(xdev, part, settings,
+					   count - (settings - buf));
+		if (!lines) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		if (*lines) {
+			mutex_lock(&part->lock);
+			ret = xvip_profile_add(part, name, lines,
+					       strlen(lines));
+			mutex_unlock(&part->lock);
+			defined = true;
+		}
+		kfree(lines);
+
+		if (ret < 0)
+			break;
+	}
+
+	/* A profile without settings is defined on the primary device. */
+	if (!ret && !defined) {
+		mutex_lock(&xdev->lock);
+		ret = xvip_profile_add(xdev, name, "", 0);
+		mutex_unlock(&xdev->lock);
+	}
+
+	kfree(name);
+	return ret < 0 ? ret : count;
+}
+
+static DEVICE_ATTR_WO(profile_define);
+
+static ssize_t sync_group_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+	ssize_t ret;
+
+	mutex_lock(&xvip_sync_lock);
+	ret = snprintf(buf, PAGE_SIZE, "%s\n",
+		       xdev->sync_group ? xdev->sync_group->name : "");
+	mutex_unlock(&xvip_sync_lock);
+
+	return ret;
+}
+
+/* Join the named group, or leave the current one on an empty write. */
+static ssize_t sync_group_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+	char *name;
+	int ret = 0;
+
+	name = kstrndup(buf, count, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+
+	mutex_lock(&xvip_sync_lock);
+	if (*strim(name))
+		ret = xvip_sync_group_join(xdev, strim(name));
+	else
+		xvip_sync_group_leave(xdev);
+	mutex_unlock(&xvip_sync_lock);
+
+	kfree(name);
+
+	return ret < 0 ? ret : count;
+}
+
+static DEVICE_ATTR_RW(sync_group);
+
+/* Start the sync group, the value is the lead time in microseconds. */
+static ssize_t sync_start_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+	unsigned int lead_us = XVIP_SYNC_DEFAULT_LEAD_US;
+	int ret;
+
+	if (count && !isspace(buf[0])) {
+		ret = kstrtouint(buf, 0, &lead_us);
+		if (ret < 0)
+			return ret;
+	}
+
+	mutex_lock(&xvip_sync_lock);
+	if (xdev->sync_group)
+		ret = xvip_sync_group_start(xdev->sync_group, lead_us);
+	else
+		ret = -ENOENT;
+	mutex_unlock(&xvip_sync_lock);
+
+	return ret < 0 ? ret : count;
+}
+
+static DEVICE_ATTR_WO(sync_start);
+
+static ssize_t sync_skew_ns_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+	ssize_t ret;
+
+	mutex_lock(&xvip_sync_lock);
+	if (xdev->sync_group)
+		ret = snprintf(buf, PAGE_SIZE, "%lld\n",
+			       ktime_to_ns(xdev->sync_group->skew));
+	else
+		ret = -ENOENT;
+	mutex_unlock(&xvip_sync_lock);
+
+	return ret;
+}
+
+static DEVICE_ATTR_RO(sync_skew_ns);
+
+static ssize_t scheduled_start_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+	struct xvip_composite_device *part;
+	const char *clock;
+	ssize_t len = 0;
+
+	/* One line per partition. */
+	list_for_each_entry(part, &xdev->partitions, partition) {
+		mutex_lock(&part->lock);
+		clock = part->sync_clock == CLOCK_TAI ? "tai" : "monotonic";
+		if (part->start_scheduled)
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+					 "armed %s %lld\n", clock,
+					 ktime_to_ns(part->sync_deadline));
+		else if (part->commit_time)
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+					 "%s %s %lld error %lld ns\n",
+					 part->commit_result < 0 ?
+					 "failed" : "committed", clock,
+					 ktime_to_ns(part->commit_time),
+					 ktime_to_ns(ktime_sub(part->commit_time,
+							part->sync_deadline)));
+		else
+			len += scnprintf(buf + len, PAGE_SIZE - len, "idle\n");
+		mutex_unlock(&part->lock);
+	}
+
+	return len;
+}
+
+/*
+ * Arm a start of all partitions with "tai <ns>" or "monotonic <ns>", disarm
+ * it and stop the prepared pipelines with "cancel".
+ */
+static ssize_t scheduled_start_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
 {
-	struct fwnode_handle *remote;
-	struct fwnode_handle *ep = NULL;
-	int ret = 0;
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+	struct xvip_composite_device *part;
+	char *args, *p, *token;
+	clockid_t clock;
+	s64 time;
+	int ret;
 
-	//dev_dbg(xdev->dev, "parsing node %pOF\n", node);
+	args = kstrndup(buf, count, GFP_KERNEL);
+	if (!args)
+		return -ENOMEM;
 
-	while (1) {
-		struct v4l2_async_subdev *asd;
-		
-		ep = fwnode_graph_get_next_endpoint(fwnode, ep);
-		if (ep == NULL)
+	p = args;
+	token = xvip_next_token(&p);
+	if (token && !strcmp(token, "cancel")) {
+		list_for_each_entry(part, &xdev->partitions, partition)
+			xvip_stop_stream(part);
+		ret = 0;
+		goto done;
+	}
+
+	if (token && !strcmp(token, "tai")) {
+		clock = CLOCK_TAI;
+	} else if (token && !strcmp(token, "monotonic")) {
+		clock = CLOCK_MONOTONIC;
+	} else {
+		ret = -EINVAL;
+		goto done;
+	}
+
+	token = xvip_next_token(&p);
+	ret = token ? kstrtos64(token, 0, &time) : -EINVAL;
+	if (ret < 0)
+		goto done;
+
+	list_for_each_entry(part, &xdev->partitions, partition) {
+		ret = xvip_schedule_start(part, clock, ns_to_ktime(time));
+		if (ret < 0)
 			break;
+	}
 
-		//dev_dbg(xdev->dev, "handling endpoint %pOF\n", ep);
+	/* Disarm the partitions already armed. */
+	if (ret < 0) {
+		list_for_each_entry_continue_reverse(part, &xdev->partitions,
+						     partition)
+			xvip_stop_stream(part);
+	}
 
-		remote = fwnode_graph_get_remote_port_parent(ep);
-		if (remote == NULL) {
-			ret = -EINVAL;
-			goto err_notifier_cleanup;
-		}
-		
-		fwnode_handle_put(ep);
+done:
+	kfree(args);
+	return ret < 0 ? ret : count;
+}
 
-		/* Skip entities that we have already processed. */
-		if (remote == of_fwnode_handle(xdev->dev->of_node) ||
-		    xvip_graph_find_entity(xdev, remote)) {
-			fwnode_handle_put(remote);
-			continue;
-		}
+static DEVICE_ATTR_RW(scheduled_start);
 
-		asd = v4l2_async_notifier_add_fwnode_subdev(
-			&xdev->notifier, remote,
-			sizeof(struct xvip_graph_entity));
-		fwnode_handle_put(remote);
-		if (IS_ERR(asd)) {
-			ret = PTR_ERR(asd);
-			goto err_notifier_cleanup;
-		}
+static ssize_t thermal_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+	struct xvip_composite_device *part;
+	struct xvip_thermal *th;
+	ssize_t len = 0;
+
+	list_for_each_entry(part, &xdev->partitions, partition) {
+		mutex_lock(&part->lock);
+		list_for_each_entry(th, &part->thermals, list)
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+					 "%s %d mC level %u/%u%s events %u\n",
+					 th->entity->entity->name, th->temp,
+					 th->level, th->num_trips,
+					 th->level > th->num_intervals ?
+					 " standby" : "", th->events);
+		mutex_unlock(&part->lock);
 	}
 
-	return 0;
+	return len;
+}
 
-err_notifier_cleanup:
-	v4l2_async_notifier_cleanup(&xdev->notifier);
-	fwnode_handle_put(ep);
-	return ret;
+static DEVICE_ATTR_RO(thermal);
+
+static ssize_t cpu_latency_us_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+
+	return snprintf(buf, PAGE_SIZE, "%d\n", xdev->qos_latency_us);
 }
 
-static int xvip_graph_parse(struct xvip_composite_device *xdev)
+/* A negative bound disables the CPU latency request. */
+static ssize_t cpu_latency_us_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
 {
-	struct xvip_graph_entity *entity;
-	struct v4l2_async_subdev *asd;
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+	struct xvip_composite_device *part;
+	s32 value;
 	int ret;
 
-	/*
-	 * Walk the links to parse the full graph. Start by parsing the
-	 * composite node and then parse entities in turn. The list_for_each
-	 * loop will handle entities added at the end of the list while walking
-	 * the links.
-	 */
-	ret = xvip_graph_parse_one(xdev, of_fwnode_handle(xdev->dev->of_node));
+	ret = kstrtos32(buf, 0, &value);
 	if (ret < 0)
-		return 0;
+		return ret;
 
-	list_for_each_entry(asd, &xdev->notifier.asd_list, asd_list) {
-		entity = to_xvip_entity(asd);
-		ret = xvip_graph_parse_one(xdev, entity->asd.match.fwnode);
-		if (ret < 0) {
-			v4l2_async_notifier_cleanup(&xdev->notifier);
-			break;
+	list_for_each_entry(part, &xdev->partitions, partition) {
+		mutex_lock(&part->lock);
+		part->qos_latency_us = value;
+		if (cpu_latency_qos_request_active(&part->qos)) {
+			if (value < 0)
+				xvip_qos_put(part);
+			else
+				cpu_latency_qos_update_request(&part->qos,
+							       value);
 		}
+		mutex_unlock(&part->lock);
 	}
 
+	return count;
+}
+
+static DEVICE_ATTR_RW(cpu_latency_us);
+
+static ssize_t control_policy_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+	ssize_t ret;
+
+	mutex_lock(&xdev->control_lock);
+	ret = snprintf(buf, PAGE_SIZE, "%s\n",
+		       xvip_control_policies[xdev->control_policy]);
+	mutex_unlock(&xdev->control_lock);
+
 	return ret;
 }
 
-static void xvip_graph_cleanup(struct xvip_composite_device *xdev)
+static ssize_t control_policy_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
 {
-	v4l2_async_notifier_unregister(&xdev->notifier);
-	v4l2_async_notifier_cleanup(&xdev->notifier);
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+	int ret;
+
+	ret = sysfs_match_string(xvip_control_policies, buf);
+	if (ret < 0)
+		return ret;
+
+	mutex_lock(&xdev->control_lock);
+	xdev->control_policy = ret;
+	ret = xvip_control_apply(xdev);
+	mutex_unlock(&xdev->control_lock);
+
+	return ret < 0 ? ret : count;
 }
 
-static int xvip_graph_init(struct xvip_composite_device *xdev)
+static DEVICE_ATTR_RW(control_policy);
+
+static ssize_t control_cpus_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+	ssize_t ret;
+
+	mutex_lock(&xdev->control_lock);
+	ret = snprintf(buf, PAGE_SIZE, "%*pbl\n",
+		       cpumask_pr_args(&xdev->control_cpus));
+	mutex_unlock(&xdev->control_lock);
+
+	return ret;
+}
+
+/* Takes a CPU list, an empty list lets the worker run on any CPU. */
+static ssize_t control_cpus_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
 {
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+	cpumask_var_t cpus;
 	int ret;
 
-	/* Parse the graph to extract a list of subdevice DT nodes. */
-	ret = xvip_graph_parse(xdev);
-	if (ret < 0) {
-		dev_err(xdev->dev, "graph parsing failed\n");
-		goto done;
-	}
+	if (!alloc_cpumask_var(&cpus, GFP_KERNEL))
+		return -ENOMEM;
 
-	if (list_empty(&xdev->notifier.asd_list)) {
-		dev_err(xdev->dev, "no subdev found in graph\n");
-		goto done;
+	ret = cpulist_parse(buf, cpus);
+	if (!ret) {
+		mutex_lock(&xdev->control_lock);
+		cpumask_copy(&xdev->control_cpus, cpus);
+		ret = xvip_control_apply(xdev);
+		mutex_unlock(&xdev->control_lock);
 	}
 
-	/* Register the subdevices notifier. */
-	xdev->notifier.ops = &xvip_graph_notify_ops;
+	free_cpumask_var(cpus);
 
-	ret = v4l2_async_notifier_register(&xdev->v4l2_dev, &xdev->notifier);
-	if (ret < 0) {
-		dev_err(xdev->dev, "notifier registration failed\n");
-		goto done;
+	return ret < 0 ? ret : count;
+}
+
+static DEVICE_ATTR_RW(control_cpus);
+
+/* The totals cover all partitions, followed by the counts of each entity. */
+static ssize_t stats_show(struct device *dev, struct device_attribute *attr,
+			  char *buf)
+{
+	struct xvip_composite_device *xdev = dev_get_drvdata(dev);
+	struct xvip_composite_device *part;
+	struct xvip_stats total = { 0 };
+	struct xvip_stats stats;
+	unsigned long frame_syncs;
+	ssize_t len;
+	unsigned int i;
+	int cpu;
+
+	list_for_each_entry(part, &xdev->partitions, partition) {
+		xvip_stats_sum(part, &stats);
+		total.events += stats.events;
+		total.frame_syncs += stats.frame_syncs;
+		total.ctrl_notifies += stats.ctrl_notifies;
 	}
 
-	ret = 0;
+	len = scnprintf(buf, PAGE_SIZE,
+			"events %lu\nframe_syncs %lu\nctrl_notifies %lu\n",
+			total.events, total.frame_syncs, total.ctrl_notifies);
 
-done:
-	if (ret < 0)
-		xvip_graph_cleanup(xdev);
+	list_for_each_entry(part, &xdev->partitions, partition) {
+		mutex_lock(&part->lock);
+		for (i = 0; i < part->num_subdevs; i++) {
+			frame_syncs = 0;
+			for_each_possible_cpu(cpu)
+				frame_syncs += READ_ONCE(per_cpu_ptr(
+					part->entity_frame_syncs, cpu)[i]);
+			if (frame_syncs)
+				len += scnprintf(buf + len, PAGE_SIZE - len,
+						 "%s frame_syncs %lu\n",
+						 part->entities[i].entity->name,
+						 frame_syncs);
+		}
+		mutex_unlock(&part->lock);
+	}
 
-	return ret;
+	return len;
 }
 
+static DEVICE_ATTR_RO(stats);
+
+static struct attribute *xvip_attrs[] = {
+        &dev_attr_stream_start.attr,
+        &dev_attr_ctrl_cache.attr,
+        &dev_attr_ctrl_cache_period_ms.attr,
+        &dev_attr_ctrl_batch.attr,
+        &dev_attr_reconfigure.attr,
+        &dev_attr_profile.attr,
+        &dev_attr_profile_define.attr,
+        &dev_attr_sync_group.attr,
+        &dev_attr_sync_start.attr,
+        &dev_attr_sync_skew_ns.attr,
+        &dev_attr_scheduled_start.attr,
+        &dev_attr_thermal.attr,
+        &dev_attr_cpu_latency_us.attr,
+        &dev_attr_control_policy.attr,
+        &dev_attr_control_cpus.attr,
+        &dev_attr_stats.attr,
+        NULL,
+};
+
+static const struct attribute_group xvip_attr_group = {
+        .attrs = xvip_attrs,
+};
+
 /* -----------------------------------------------------------------------------
- * Media Controller and V4L2
+ * Debugfs
  */
 
-static void xvip_composite_v4l2_cleanup(struct xvip_composite_device *xdev)
+static void xvip_dot_print_entity(struct seq_file *s,
+				  struct xvip_composite_device *xdev,
+				  struct media_entity *entity)
 {
-	v4l2_device_unregister(&xdev->v4l2_dev);
-	media_device_unregister(&xdev->media_dev);
-	media_device_cleanup(&xdev->media_dev);
+	struct xvip_graph_entity *xvip_entity;
+	unsigned int i;
+	bool first;
+
+	xvip_entity = xvip_entity_from_media(entity);
+
+	seq_printf(s, "\tn%08x [label=\"{{", entity->graph_obj.id);
+	for (i = 0, first = true; i < entity->num_pads; i++) {
+		if (!(entity->pads[i].flags & MEDIA_PAD_FL_SINK))
+			continue;
+		seq_printf(s, "%s<port%u> %u", first ? "" : " | ", i, i);
+		first = false;
+	}
+	seq_printf(s, "} | %s", entity->name);
+
+	if (xvip_entity) {
+		const struct v4l2_fract *ival = &xvip_entity->interval;
+
+		seq_printf(s, "\\n%s", xvip_entity->streaming ?
+			   "streaming" : "stopped");
+		if (xvip_entity->start_latency)
+			seq_printf(s, "\\nstart %lld us",
+				   ktime_to_us(xvip_entity->start_latency));
+		if (ival->numerator)
+			seq_printf(s, "\\n%u.%02u fps",
+				   ival->denominator / ival->numerator,
+				   ival->denominator % ival->numerator * 100 /
+				   ival->numerator);
+	}
+
+	seq_puts(s, " | {");
+	for (i = 0, first = true; i < entity->num_pads; i++) {
+		if (!(entity->pads[i].flags & MEDIA_PAD_FL_SOURCE))
+			continue;
+		seq_printf(s, "%s<port%u> %u", first ? "" : " | ", i, i);
+		first = false;
+	}
+	seq_printf(s, "}}\", shape=Mrecord, style=filled, fillcolor=%s]\n",
+		   xvip_entity && xvip_entity->streaming ? "green" : "white");
 }
 
-static int xvip_composite_v4l2_init(struct xvip_composite_device *xdev)
+static int xvip_graph_dot_show(struct seq_file *s, void *unused)
 {
-	int ret;
+	struct xvip_composite_device *xdev = s->private;
+	struct media_device *mdev = &xdev->media_dev;
+	struct media_entity *entity;
+	struct media_link *link;
 
-	xdev->media_dev.dev = xdev->dev;
-	strscpy(xdev->media_dev.model, "Xilinx Video Composite Device",
-		sizeof(xdev->media_dev.model));
-	xdev->media_dev.hw_revision = 0;
+	mutex_lock(&xdev->lock);
+	mutex_lock(&mdev->graph_mutex);
 
-	media_device_init(&xdev->media_dev);
+	seq_puts(s, "digraph board {\n\trankdir=TB\n");
 
-	xdev->v4l2_dev.mdev = &xdev->media_dev;
-	ret = v4l2_device_register(xdev->dev, &xdev->v4l2_dev);
-	if (ret < 0) {
-		dev_err(xdev->dev, "V4L2 device registration failed (%d)\n",
-			ret);
-		media_device_cleanup(&xdev->media_dev);
-		return ret;
+	media_device_for_each_entity(entity, mdev)
+		xvip_dot_print_entity(s, xdev, entity);
+
+	media_device_for_each_entity(entity, mdev) {
+		list_for_each_entry(link, &entity->links, list) {
+			if ((link->flags & MEDIA_LNK_FL_LINK_TYPE) !=
+			    MEDIA_LNK_FL_DATA_LINK)
+				continue;
+			if (link->source->entity != entity)
+				continue;
+
+			seq_printf(s, "\tn%08x:port%u -> n%08x:port%u [style=%s]\n",
+				   entity->graph_obj.id, link->source->index,
+				   link->sink->entity->graph_obj.id,
+				   link->sink->index,
+				   link->flags & MEDIA_LNK_FL_ENABLED ?
+				   "bold" : "dashed");
+		}
 	}
 
+	seq_puts(s, "}\n");
+
+	mutex_unlock(&mdev->graph_mutex);
+	mutex_unlock(&xdev->lock);
+
 	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(xvip_graph_dot);
 
-static void xvip_start_stream(void)
+static int xvip_components_show(struct seq_file *s, void *unused)
 {
+	struct xvip_composite_device *xdev = s->private;
+	struct xvip_component *component;
 	struct xvip_graph_entity *entity;
-	struct v4l2_async_subdev *asd;
-	dev_dbg(g_xdev->dev, "Starting the stream \n");
-	list_for_each_entry(asd, &g_xdev->notifier.asd_list, asd_list) {
-		entity = to_xvip_entity(asd);
-		xvip_entity_start_stop(g_xdev, entity, true);
+	unsigned int i, j, k;
+
+	mutex_lock(&xdev->lock);
+
+	xvip_components_update(xdev);
+
+	for (i = 0; i < xdev->num_components; i++) {
+		component = &xdev->components[i];
+
+		seq_printf(s, "component %u:", i);
+		for (j = 0; j < component->num_entities; j++) {
+			entity = &xdev->entities[
+				xdev->start_order[component->first + j]];
+			seq_printf(s, " \"%s\"", entity->entity->name);
+		}
+		seq_puts(s, "\n");
+
+		for (j = 0; j < component->num_entities; j++) {
+			entity = &xdev->entities[
+				xdev->start_order[component->first + j]];
+			if (!entity->downstream)
+				continue;
+
+			seq_puts(s, "\tchain:");
+			for (k = 0; k < entity->num_downstream; k++)
+				seq_printf(s, " \"%s\"", xdev->entities[
+					entity->downstream[k]].entity->name);
+			seq_puts(s, "\n");
+		}
 	}
-	g_xdev->is_streaming = true;
+
+	mutex_unlock(&xdev->lock);
+
+	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(xvip_components);
 
-static ssize_t xvip_start_stream_show(
-	struct device *dev,
-	struct device_attribute *attr,
-	char *buf)
+static ssize_t xvip_static_key_read(struct file *file, char __user *user_buf,
+				    size_t count, loff_t *ppos)
 {
-	return snprintf(buf, PAGE_SIZE, "%d\n", g_xdev->is_streaming);
+	struct static_key_false *key = file->private_data;
+	char buf[3];
+
+	buf[0] = static_key_enabled(key) ? 'Y' : 'N';
+	buf[1] = '\n';
+	buf[2] = '\0';
+
+	return simple_read_from_buffer(user_buf, count, ppos, buf, 2);
 }
 
-static ssize_t xvip_start_stream_store(
-	struct device *dev,
-	struct device_attribute *attr,
-	const char *buf,
-	size_t count)
+static ssize_t xvip_static_key_write(struct file *file,
+				     const char __user *user_buf,
+				     size_t count, loff_t *ppos)
 {
-	xvip_start_stream();
+	struct static_key_false *key = file->private_data;
+	bool enable;
+	int ret;
+
+	ret = kstrtobool_from_user(user_buf, count, &enable);
+	if (ret < 0)
+		return ret;
+
+	if (enable)
+		static_branch_enable(key);
+	else
+		static_branch_disable(key);
 
 	return count;
 }
 
-static DEVICE_ATTR(stream_start, S_IRUSR | S_IWUSR, xvip_start_stream_show, xvip_start_stream_store);
-
-static struct attribute *xvip_attrs[] = {
-        &dev_attr_stream_start.attr,
-        NULL,
+static const struct file_operations xvip_static_key_fops = {
+	.open = simple_open,
+	.read = xvip_static_key_read,
+	.write = xvip_static_key_write,
+	.llseek = default_llseek,
 };
 
-static const struct attribute_group xvip_attr_group = {
-        .attrs = xvip_attrs,
-};
+static void xvip_debugfs_init(struct xvip_composite_device *xdev)
+{
+	char name[32];
+
+	if (xdev->index)
+		snprintf(name, sizeof(name), "%s.%u", dev_name(xdev->dev),
+			 xdev->index);
+	else
+		strscpy(name, dev_name(xdev->dev), sizeof(name));
+
+	xdev->debugfs_dir = debugfs_create_dir(name, NULL);
+	debugfs_create_file("graph.dot", 0444, xdev->debugfs_dir, xdev,
+			    &xvip_graph_dot_fops);
+	debugfs_create_file("components", 0444, xdev->debugfs_dir, xdev,
+			    &xvip_components_fops);
+}
+
+static void xvip_debugfs_cleanup(struct xvip_composite_device *xdev)
+{
+	debugfs_remove_recursive(xdev->debugfs_dir);
+}
 
 /* media_ctl probe and remove */
 
 static int media_ctl_probe(struct platform_device *pdev)
 {
 	/* For video4Linux */
+	struct xvip_composite_device *xdev;
+	struct xvip_composite_device *part;
+	const char *sync_group;
 	int ret;
 
-	g_xdev = devm_kzalloc(&pdev->dev, sizeof(*g_xdev), GFP_KERNEL);
-	if (!g_xdev)
+	xdev = devm_kzalloc(&pdev->dev, sizeof(*xdev), GFP_KERNEL);
+	if (!xdev)
 		return -ENOMEM;
 
-	g_xdev->dev = &pdev->dev;
-	v4l2_async_notifier_init(&g_xdev->notifier);
+	ret = xvip_composite_setup(xdev, &pdev->dev);
+	if (ret < 0)
+		return ret;
+
+	list_add_tail(&xdev->partition, &xdev->partitions);
+	platform_set_drvdata(pdev, xdev);
 
-	ret = xvip_composite_v4l2_init(g_xdev);
+	ret = xvip_ctrl_cache_parse(xdev);
 	if (ret < 0)
 		return ret;
 
-	ret = xvip_graph_init(g_xdev);
+	ret = xvip_icc_init(xdev);
+	if (ret < 0)
+		return ret;
+
+	ret = xvip_control_init(xdev);
+	if (ret < 0) {
+		icc_put(xdev->icc_path);
+		return ret;
+	}
+
+	ret = xvip_composite_v4l2_init(xdev);
+	if (ret < 0) {
+		kthread_destroy_worker(xdev->control_worker);
+		icc_put(xdev->icc_path);
+		return ret;
+	}
+
+	ret = xvip_graph_init(xdev);
 	if (ret < 0)
 		goto error;
 
+	if (!of_property_read_string(pdev->dev.of_node, "topic,sync-group",
+				     &sync_group)) {
+		mutex_lock(&xvip_sync_lock);
+		ret = xvip_sync_group_join(xdev, sync_group);
+		mutex_unlock(&xvip_sync_lock);
+		if (ret < 0)
+			dev_err(&pdev->dev, "failed to join sync group %s\n",
+				sync_group);
+	}
+
+	dev_dbg(&pdev->dev, "probed in %lld us\n",
+		ktime_us_delta(ktime_get(), xdev->probe_time));
+
 	/* Register attribute */
 	ret = sysfs_create_group(&pdev->dev.kobj, &xvip_attr_group);
 	if (ret)
 		dev_err(&pdev->dev, "sysfs_create_group failed\n");
 
+	list_for_each_entry(part, &xdev->partitions, partition) {
+		xvip_debugfs_init(part);
+		if (part->nl_stats_period_ms)
+			kthread_queue_delayed_work(xdev->control_worker,
+				&part->nl_stats_work,
+				msecs_to_jiffies(part->nl_stats_period_ms));
+	}
+
+	mutex_lock(&xvip_devices_lock);
+	list_add_tail(&xdev->device_entry, &xvip_devices);
+	mutex_unlock(&xvip_devices_lock);
+
 	return 0;
 
 	/* Error handling v4l */
 error:
-	xvip_composite_v4l2_cleanup(g_xdev);
+	xvip_composite_v4l2_cleanup(xdev);
+	kthread_destroy_worker(xdev->control_worker);
+	icc_put(xdev->icc_path);
 	return ret;
 }
 
+static void xvip_composite_teardown(struct xvip_composite_device *xdev)
+{
+	kthread_cancel_delayed_work_sync(&xdev->nl_stats_work);
+	xvip_debugfs_cleanup(xdev);
+	xvip_stop_stream(xdev);
+
+	/* Stop new requests from being queued, then drain the queue. */
+	media_device_unregister(&xdev->media_dev);
+	flush_work(&xdev->request_work);
+	cancel_work_sync(&xdev->validate_work);
+	xvip_graph_cleanup(xdev);
+	xvip_ctrl_cache_cleanup(xdev);
+	xvip_composite_v4l2_cleanup(xdev);
+	icc_put(xdev->icc_path);
+}
+
 static int media_ctl_remove(struct platform_device *pdev)
 {
 	/* Video 4 Linux cleanup */
-	struct xvip_composite_device *g_xdev = platform_get_drvdata(pdev);
+	struct xvip_composite_device *xdev = platform_get_drvdata(pdev);
+	struct xvip_composite_device *part;
+
+	/* New netlink commands can't find the device, wait for the others. */
+	mutex_lock(&xvip_devices_lock);
+	list_del(&xdev->device_entry);
+	mutex_unlock(&xvip_devices_lock);
+	wait_event(xdev->nl_wq, !atomic_read(&xdev->nl_users));
 
-	xvip_graph_cleanup(g_xdev);
-	xvip_composite_v4l2_cleanup(g_xdev);
+	sysfs_remove_group(&pdev->dev.kobj, &xvip_attr_group);
+
+	mutex_lock(&xvip_sync_lock);
+	xvip_sync_group_leave(xdev);
+	mutex_unlock(&xvip_sync_lock);
+
+	list_for_each_entry_reverse(part, &xdev->partitions, partition)
+		xvip_composite_teardown(part);
+
+	kthread_destroy_worker(xdev->control_worker);
 
 	return 0;
 }
@@ -635,8 +6229,42 @@ static struct platform_driver media_ctl_driver = {
 		.name = "topic_mediactl",
 		.owner = THIS_MODULE,
 		.of_match_table = media_ctl_ids,
+		/*
+		 * Graph parsing, the graph firmware request and the notifier
+		 * registration don't need to hold up the boot.
+		 */
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 	},
 	.probe = media_ctl_probe,
 	.remove = media_ctl_remove,
 };
-module_platform_driver(media_ctl_driver);
+
+static int __init media_ctl_init(void)
+{
+	int ret;
+
+	ret = genl_register_family(&xvip_nl_family);
+	if (ret < 0)
+		return ret;
+
+	xvip_debugfs_root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	debugfs_create_file("timing", 0644, xvip_debugfs_root,
+			    &xvip_timing_key, &xvip_static_key_fops);
+
+	ret = platform_driver_register(&media_ctl_driver);
+	if (ret < 0) {
+		debugfs_remove_recursive(xvip_debugfs_root);
+		genl_unregister_family(&xvip_nl_family);
+	}
+
+	return ret;
+}
+module_init(media_ctl_init);
+
+static void __exit media_ctl_exit(void)
+{
+	platform_driver_unregister(&media_ctl_driver);
+	debugfs_remove_recursive(xvip_debugfs_root);
+	genl_unregister_family(&xvip_nl_family);
+}
+module_exit(media_ctl_exit);